@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Run radplex on the benchmark reads and compare throughput against a
+# stored baseline.
+#
+# Usage: bench.sh <radplex> <data directory> <baseline file> <tolerance %> <runs> [update|train]
+#
+# The best reads/s of all runs is used. Fails if it is more than
+# tolerance percent below the baseline. With "update", the result is
+# written to the baseline file instead. With "train", radplex is only
+# run, to collect a profile for a PGO build.
+#
+
+if [ $# -lt 5 ]; then
+    echo "Usage: $0 <radplex> <data directory> <baseline file> <tolerance %> <runs> [update|train]"
+    exit 1
+fi
+
+radplex=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+data=$(cd "$2" && pwd)
+baseline=$3
+tolerance=$4
+runs=$5
+work=$(mktemp -d "${TMPDIR:-/tmp}/radplex_bench.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+
+best=0
+run=1
+while [ $run -le $runs ]; do
+    rm -f "$work"/*
+    (cd "$work" && "$radplex" -a "$data/r1.fq" -b "$data/r2.fq" -c "$data/i.fq" -p bench > log.txt) || {
+        echo "Error: radplex failed, see $work/log.txt"
+        trap - EXIT
+        exit 1
+    }
+    rate=$(awk '/^Processed .* reads\/s/ { gsub(/[()]/, ""); print $(NF-1) }' "$work/log.txt")
+    echo "Run $run: $rate reads/s"
+    best=$(awk -v a="$rate" -v b="$best" 'BEGIN { print (a > b) ? a : b }')
+    run=$((run + 1))
+done
+
+if [ "$6" = "train" ]; then
+    exit 0
+fi
+
+if [ "$6" = "update" ]; then
+    {
+        echo "# Best reads/s from make bench-baseline, $(date +%Y-%m-%d) on $(uname -m)"
+        echo "$best"
+    } > "$baseline"
+    echo "Baseline set to $best reads/s in $baseline"
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "Error: no baseline in $baseline - run make bench-baseline"
+    exit 1
+fi
+
+awk -v best="$best" -v tolerance="$tolerance" -v file="$baseline" '
+/^[0-9.]+$/ { base = $1 }
+END {
+    if (base <= 0) {
+        print "Error: no reads/s value in " file
+        exit 1
+    }
+    limit = base * (100 - tolerance) / 100
+    change = 100 * (best - base) / base
+    printf("Best %.0f reads/s, baseline %.0f reads/s (%+.1f%%), limit %.0f reads/s\n", best, base, change, limit)
+    if (best < limit) {
+        printf("FAIL: throughput dropped more than %s%% below baseline\n", tolerance)
+        exit 1
+    }
+    print "PASS"
+}' "$baseline"
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Generate synthetic RADSeq reads for benchmarking radplex.
+#
+# Usage: generate_reads.sh <read pairs> <output directory> [seed]
+#
+# Writes r1.fq, r2.fq and i.fq. Reads use the default P1 and P2
+# adaptors, with some unknown barcodes, single base errors and a
+# spread of read lengths, so that every matching path is exercised.
+#
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <read pairs> <output directory> [seed]"
+    exit 1
+fi
+
+mkdir -p "$2" || exit 1
+
+awk -v n="$1" -v dir="$2" -v seed="${3:-1}" '
+function random_bases(k,    s, i) {
+    s = ""
+    for (i = 0; i < k; i++) {
+        s = s substr("ACGT", int(rand() * 4) + 1, 1)
+    }
+    return s
+}
+function mutate(s,    i) {
+    if (rand() < 0.2) {
+        i = int(rand() * length(s)) + 1
+        s = substr(s, 1, i - 1) substr("ACGTN", int(rand() * 5) + 1, 1) substr(s, i + 1)
+    }
+    return s
+}
+function qualities(k,    s, i) {
+    s = ""
+    for (i = 0; i < k; i++) {
+        s = s substr(qchars, int(rand() * length(qchars)) + 1, 1)
+    }
+    if (length(s) != k) {
+        print "Error: quality line does not match sequence" > "/dev/stderr"
+        exit 1
+    }
+    return s
+}
+BEGIN {
+    srand(seed)
+    np1 = split("TGAG ACGTA CTCCGA GATACCA GGCA CTAGG ACGCAC TATTCAA GTAT TACGT CCGCAC AGTAGAA", p1, " ")
+    np2 = split("AATAGTT ACCGACC ATGGCAA CCGGTCG GACCTGG GTTCGGT TGAACTA TGATAAC", p2, " ")
+    qchars = "#$%&()*+,-./0123456789:;<=>?@ABCDEFGHI"
+    r1 = dir "/r1.fq"
+    r2 = dir "/r2.fq"
+    ri = dir "/i.fq"
+    for (r = 0; r < n; r++) {
+        a = (rand() < 0.9) ? p1[int(rand() * np1) + 1] : random_bases(5)
+        b = (rand() < 0.9) ? p2[int(rand() * np2) + 1] : random_bases(7)
+        if (rand() < 0.95) {
+            l = (rand() < 0.5) ? 150 : 100
+        } else {
+            l = 20 + int(rand() * 280)
+        }
+        s1 = mutate(a "TGCAG") random_bases(l)
+        s2 = random_bases(l)
+        b = mutate(b)
+        h = sprintf("@BENCH:1:FC:1:%d:%d:%d", int(r / 1000), r % 1000, r)
+        printf("%s 1:N:0:%s\n%s\n+\n%s\n", h, b, s1, qualities(length(s1))) > r1
+        printf("%s 2:N:0:%s\n%s\n+\n%s\n", h, b, s2, qualities(length(s2))) > r2
+        printf("%s 3:N:0:%s\n%s\n+\n%s\n", h, b, b, qualities(length(b))) > ri
+    }
+}' || {
+    # Don't leave partial data for make to treat as up to date
+    rm -f "$2/r1.fq" "$2/r2.fq" "$2/i.fq"
+    exit 1
+}
@@ -12,50 +12,234 @@
 #include <getopt.h> 
 #include <ctype.h>
 #include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+// io_uring needs 5.6 kernel headers for IORING_OP_WRITE, which has no
+// macro of its own, so test for IORING_FEAT_RW_CUR_POS from the same
+// release. Build with -DNO_IO_URING to always use blocking writes.
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) && !defined(NO_IO_URING)
+#define HAVE_IO_URING
+#endif
 
 /*----------------------------------------------------------------------*
  * Constants
  *----------------------------------------------------------------------*/
-#define MAX_READ_LENGTH 10000
 #define MAX_ADAPTORS 100
 #define MAX_PATH_LENGTH 1024
+#define MAX_PREFIX_LENGTH 960
 #define MAX_HASH 7
 #define UNDETERMINED_HASH_SIZE 279936
+#define INDEX_FROM_FILE 0
+#define INDEX_FROM_HEADER 1
+#define INDEX_FROM_READ2 2
+#define OUTPUT_FASTQ 0
+#define OUTPUT_BINARY 1
+#define OUTPUT_MANIFEST 2
+#define OUTPUT_BUFFER_SIZE 65536
+#define MAX_FREE_BUFFERS 256
+#define URING_QUEUE_DEPTH 32
+#define BATCH_SIZE 4096
+#define INITIAL_ARENA_SIZE 1048576
+#define MIN_ARENA_SPACE 4096
+#define FASTQ_HEADER 0
+#define FASTQ_SEQUENCE 1
+#define FASTQ_QUALITIES_HEADER 2
+#define FASTQ_QUALITIES 3
+#define QC_INITIAL_POSITIONS 256
+#define QC_QUALITY_OFFSET 33
+#define CHECKPOINT_VERSION 3
+#define BINARY_FILE_MAGIC "RPXB"
+#define BINARY_INDEX_MAGIC "RPXI"
+#define BINARY_VERSION 1
+#define BINARY_BLOCK_SIZE 1048576
+#define BINARY_FILE_HEADER_SIZE 16
+#define BINARY_BLOCK_HEADER_SIZE 8
+#define BINARY_INDEX_ENTRY_SIZE 20
+#define BINARY_FOOTER_SIZE 16
+#define BINARY_FLAG_BINNED_QUALITIES 1
+#define BINARY_RECORD_HAS_N 1
+#define BINARY_MAX_HEADER_LENGTH 65535
+#define MAX_MANIFEST_LINE 1024
+
+// Hot kernels are built once per instruction set and the best version
+// is picked when the program loads. Build with -DNO_CPU_DISPATCH to
+// get a single generic version.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(NO_CPU_DISPATCH)
+#define CPU_DISPATCH __attribute__((target_clones("avx2", "popcnt", "default")))
+#else
+#define CPU_DISPATCH
+#endif
 
 /*----------------------------------------------------------------------*
  * Structures
  *----------------------------------------------------------------------*/
 typedef struct {
-    char sequence_header[MAX_READ_LENGTH];
-    char sequence[MAX_READ_LENGTH];
-    char qualities_header[MAX_READ_LENGTH];
-    char qualities[MAX_READ_LENGTH];
+    char* sequence_header;
+    char* sequence;
+    char* qualities_header;
+    char* qualities;
+    int sequence_length;
+    long long ordinal;
+    off_t input_offset;
 } FastqRead;
 
+typedef struct {
+    size_t offset[4];
+    int length[4];
+    off_t input_offset;
+} FastqRecord;
+
+typedef struct {
+    char* arena;
+    size_t arena_size;
+    size_t arena_used;
+    long long first_ordinal;
+    int n_records;
+    FastqRecord record[BATCH_SIZE][3];
+} FastqBatch;
+
+typedef struct {
+    uint64_t p1_bases[BATCH_SIZE];
+    uint64_t p1_invalid[BATCH_SIZE];
+    uint64_t p2_bases[BATCH_SIZE];
+    uint64_t p2_invalid[BATCH_SIZE];
+    int p1_index[BATCH_SIZE];
+    int p2_index[BATCH_SIZE];
+    int sample[BATCH_SIZE];
+    int order[BATCH_SIZE];
+    int sample_start[MAX_ADAPTORS * MAX_ADAPTORS + 1];
+} BatchClassification;
+
 typedef struct {
     char* input_filename[3];
     FILE* input_fp[3];
-    FastqRead read[3];
+    off_t input_offset[3];
+    int n_input_files;
     int pairs_of_reads;
 } FastqReadPair;
 
+typedef struct {
+    long quality_sum;
+    long bases[5];
+} QCPosition;
+
+typedef struct {
+    long reads;
+    long bases;
+    long n_bases;
+    long reads_with_n;
+    long remnant_reads;
+    int positions;
+    QCPosition* position;
+    long* length_histogram;
+} QCStats;
+
+typedef struct {
+    off_t offset;
+    long long first_record;
+    int n_records;
+} BinaryIndexEntry;
+
+typedef struct {
+    unsigned char* block;
+    size_t block_size;
+    size_t block_used;
+    int block_records;
+    long long records;
+    BinaryIndexEntry* index;
+    int n_blocks;
+    int index_size;
+} BinaryOutput;
+
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t buffer_used;
+    off_t offset;
+    int in_flight;
+    BinaryOutput* binary;
+} OutputFile;
+
+typedef struct {
+    OutputFile* file;
+    char* buffer;
+    size_t length;
+    off_t offset;
+} URingSlot;
+
+typedef struct {
+    int ring_fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+#endif
+    URingSlot slots[URING_QUEUE_DEPTH];
+    int in_flight;
+} URing;
+
 /*----------------------------------------------------------------------*
  * Globals
  *----------------------------------------------------------------------*/
 int allowed_mismatches = 1;
 int verbose = 0;
 char adaptor_filename[2][MAX_PATH_LENGTH];
-char output_prefix[MAX_PATH_LENGTH];
+char output_prefix[MAX_PREFIX_LENGTH];
 char* adaptors[2][MAX_ADAPTORS];
 int n_adaptors[2];
-FILE* undetermined_fp[2];
-FILE* out_fp[MAX_ADAPTORS][MAX_ADAPTORS][2];
+OutputFile* undetermined_fp[2];
+OutputFile* out_fp[MAX_ADAPTORS][MAX_ADAPTORS][2];
 int adaptor_counts[MAX_ADAPTORS][MAX_ADAPTORS];
 int undetermined_read_count = 0;
 int undetermined_indices[2][UNDETERMINED_HASH_SIZE];
 int total_read_count = 0;
+int resumed_read_count = 0;
 int clip_psti = 0;
 int p2_size = 7;
+int index_source = INDEX_FROM_FILE;
+int use_io_uring = 0;
+long chunk_reads = 0;
+long chunk_bytes = 0;
+int chunk_number[MAX_ADAPTORS][MAX_ADAPTORS];
+long chunk_read_count[MAX_ADAPTORS][MAX_ADAPTORS];
+FILE* chunk_manifest_fp = 0;
+int collect_qc = 0;
+QCStats* qc_stats[MAX_ADAPTORS][MAX_ADAPTORS][2];
+int checkpoint_interval = 0;
+int output_format = OUTPUT_FASTQ;
+int bin_qualities = 0;
+char* output_extension = "fastq";
+char* decode_filename = 0;
+char* extract_filename = 0;
+int binned_quality[8] = {0, 6, 15, 22, 27, 33, 37, 40};
+int batch_kernel = 0;
+int p1_prefix_length = 0;
+uint64_t adaptor_code[2][MAX_ADAPTORS];
+uint64_t adaptor_lanes[2][MAX_ADAPTORS];
+unsigned char base_code[256];
+int resume_run = 0;
+URing uring;
+char* free_buffers[MAX_FREE_BUFFERS];
+int n_free_buffers = 0;
 
 /*----------------------------------------------------------------------*
  * Function:   chomp
@@ -86,10 +270,21 @@ void usage(void)
            "    [-a | --one] FASTQ R1.\n" \
            "    [-b | --two] FASTQ R2.\n" \
            "    [-c | --index] FASTQ index read.\n" \
+           "    [-d | --decode] Convert a binary output file to FASTQ (prefix.fastq) and exit.\n" \
+           "    [-e | --extract] Write reads listed in a manifest, from input -a, to prefix.fastq and exit.\n" \
+           "    [-i | --index_source] Where to read P2 from: file (default), header or read2.\n" \
+           "    [-k | --chunk_bytes] Start new per-sample output files after this many bytes.\n" \
+           "    [-l | --bin_qualities] Store binned qualities in binary output.\n" \
            "    [-m | --mismatches] Number of allowed mismatches (default 1).\n" \
+           "    [-o | --output_format] Read output format: fastq (default), binary or manifest.\n" \
            "    [-p | --output_prefix] Output filename prefix.\n" \
+           "    [-q | --qc] Write per-sample QC reports.\n" \
+           "    [-r | --chunk_reads] Start new per-sample output files after this many reads.\n" \
            "    [-s | --p2_size] Size of P2 adaptor read (default 7).\n" \
+           "    [-u | --io_uring] Write output asynchronously with io_uring (Linux).\n" \
            "    [-v | --verbose] Verbose output.\n" \
+           "    [-x | --checkpoint] Write a checkpoint every this many read pairs.\n" \
+           "    [-y | --resume] Resume from the last checkpoint.\n" \
            "    [-z | --clip_psti] Clip PstI sequence too.\n" \
            "    [-1 | --p1] p1 Adaptor file.\n" \
            "    [-2 | --p2] p2 Adaptor file.\n" \
@@ -188,7 +383,6 @@ char n_to_base(int n)
  *----------------------------------------------------------------------*/
 int generate_hash(char* sequence)
 {
-    int multiplier = 0;
     int hash = 0;
     int i, m;
         
@@ -220,7 +414,6 @@ char* hash_to_string(int hash, char* hash_string)
 {
     int i, n, m;
     int running = hash;
-    int length = 0;
     
     for (i=0; i<MAX_HASH; i++) {
         m = (int)pow(6.0, (double)(MAX_HASH-1-i));
@@ -232,6 +425,7 @@ char* hash_to_string(int hash, char* hash_string)
             hash_string[i] = 0;
         }
     }
+    hash_string[MAX_HASH] = 0;
 
     return hash_string;
 }
@@ -332,42 +526,175 @@ void setup_default_adaptors(void)
 }
 
 /*----------------------------------------------------------------------*
- * Function:   
- * Purpose:    
- * Parameters: 
- * Returns:    
+ * Function:   allocate_batch
+ * Purpose:    Allocate a batch of records and its arena
+ * Parameters: None
+ * Returns:    Pointer to batch
  *----------------------------------------------------------------------*/
-int get_next_pair(FastqReadPair* read_pair)
+FastqBatch* allocate_batch(void)
 {
-    int i;
+    FastqBatch* batch = malloc(sizeof(FastqBatch));
     
-    for (i=0; i<3; i++) {
-        if (!fgets(read_pair->read[i].sequence_header, MAX_READ_LENGTH, read_pair->input_fp[i])) {
-            printf("End of file\n");
-            return 1;
+    if (batch) {
+        batch->arena_size = INITIAL_ARENA_SIZE;
+        batch->arena = malloc(batch->arena_size);
+    }
+    
+    if ((!batch) || (!batch->arena)) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
+    }
+    
+    batch->arena_used = 0;
+    batch->n_records = 0;
+    
+    return batch;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   free_batch
+ * Purpose:    Free a batch and its arena
+ * Parameters: batch -> batch to free
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void free_batch(FastqBatch* batch)
+{
+    free(batch->arena);
+    free(batch);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   read_line
+ * Purpose:    Read a line of any length onto the end of a batch's arena
+ * Parameters: batch -> batch to store line in
+ *             fp -> file to read from
+ *             offset -> to store arena offset of line
+ *             length -> to store length of line, without line ending
+ *             position -> input file offset, advanced past the line
+ * Returns:    1 if a line was read, 0 at end of file
+ *----------------------------------------------------------------------*/
+int read_line(FastqBatch* batch, FILE* fp, size_t* offset, int* length, off_t* position)
+{
+    size_t start = batch->arena_used;
+    size_t n;
+    int got_line = 0;
+    
+    for (;;) {
+        // Arena grows as needed and keeps its size for later batches
+        if (batch->arena_size - batch->arena_used < MIN_ARENA_SPACE) {
+            batch->arena_size *= 2;
+            batch->arena = realloc(batch->arena, batch->arena_size);
+            if (!batch->arena) {
+                printf("Error: can't allocate memory.\n");
+                exit(12);
+            }
         }
-        if (!fgets(read_pair->read[i].sequence, MAX_READ_LENGTH, read_pair->input_fp[i])) {
-            printf("Error reading input file\n");
-            return 2;
+        
+        if (!fgets(batch->arena + batch->arena_used, batch->arena_size - batch->arena_used, fp)) {
+            break;
         }
-        if (!fgets(read_pair->read[i].qualities_header, 1024, read_pair->input_fp[i])) {
-            printf("Error reading input file\n");
-            return 3;
+        
+        got_line = 1;
+        n = strlen(batch->arena + batch->arena_used);
+        batch->arena_used += n;
+        if ((n > 0) && (batch->arena[batch->arena_used - 1] == '\n')) {
+            break;
         }
-        if (!fgets(read_pair->read[i].qualities, MAX_READ_LENGTH, read_pair->input_fp[i])) {
-            printf("Error reading input file\n");
-            return 4;                   
+    }
+    
+    if (!got_line) {
+        return 0;
+    }
+    
+    *position += batch->arena_used - start;
+    
+    while ((batch->arena_used > start) && (batch->arena[batch->arena_used - 1] < ' ')) {
+        batch->arena_used--;
+    }
+    batch->arena[batch->arena_used++] = 0;
+    
+    *offset = start;
+    *length = batch->arena_used - 1 - start;
+    
+    return 1;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   check_record
+ * Purpose:    Make sure a record has a quality for every base
+ * Parameters: record -> record to check
+ *             filename -> file record came from, for error message
+ *             ordinal = record number, for error message
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void check_record(FastqRecord* record, char* filename, long long ordinal)
+{
+    if (record->length[FASTQ_QUALITIES] != record->length[FASTQ_SEQUENCE]) {
+        printf("Error: Malformed record %lld in %s - %d bases but %d qualities\n", ordinal, filename, record->length[FASTQ_SEQUENCE], record->length[FASTQ_QUALITIES]);
+        exit(7);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_next_batch
+ * Purpose:    Read up to BATCH_SIZE records from each input file
+ * Parameters: read_pair -> input files
+ *             batch -> batch to fill, previous contents are discarded
+ * Returns:    0 if batch is full, 1 at end of file, >1 on error
+ *----------------------------------------------------------------------*/
+int get_next_batch(FastqReadPair* read_pair, FastqBatch* batch)
+{
+    FastqRecord* record;
+    int i, l;
+    
+    batch->arena_used = 0;
+    batch->n_records = 0;
+    batch->first_ordinal = read_pair->pairs_of_reads + 1;
+    
+    while (batch->n_records < BATCH_SIZE) {
+        for (i=0; i<read_pair->n_input_files; i++) {
+            record = &batch->record[batch->n_records][i];
+            record->input_offset = read_pair->input_offset[i];
+            for (l=0; l<4; l++) {
+                if (!read_line(batch, read_pair->input_fp[i], &record->offset[l], &record->length[l], &read_pair->input_offset[i])) {
+                    if ((i == 0) && (l == 0)) {
+                        printf("End of file\n");
+                        return 1;
+                    }
+                    printf("Error reading input file\n");
+                    return l+2;
+                }
+            }
+            check_record(record, read_pair->input_filename[i], read_pair->pairs_of_reads + 1);
         }
         
-        chomp(read_pair->read[i].sequence_header);
-        chomp(read_pair->read[i].sequence);
-        chomp(read_pair->read[i].qualities_header);
-        chomp(read_pair->read[i].qualities);
+        batch->n_records++;
+        read_pair->pairs_of_reads++;
     }
+    
+    return 0;
+}
 
-    read_pair->pairs_of_reads++;
+/*----------------------------------------------------------------------*
+ * Function:   get_batch_read
+ * Purpose:    Point a FastqRead at one input's record inside a batch
+ * Parameters: batch -> batch containing record
+ *             r = record number
+ *             i = input file number
+ *             read -> FastqRead to fill
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void get_batch_read(FastqBatch* batch, int r, int i, FastqRead* read)
+{
+    FastqRecord* record = &batch->record[r][i];
     
-    return 0;    
+    read->sequence_header = batch->arena + record->offset[FASTQ_HEADER];
+    read->sequence = batch->arena + record->offset[FASTQ_SEQUENCE];
+    read->qualities_header = batch->arena + record->offset[FASTQ_QUALITIES_HEADER];
+    read->qualities = batch->arena + record->offset[FASTQ_QUALITIES];
+    read->sequence_length = record->length[FASTQ_SEQUENCE];
+    read->ordinal = batch->first_ordinal + r;
+    read->input_offset = record->input_offset;
 }
 
 /*----------------------------------------------------------------------*
@@ -376,12 +703,16 @@ int get_next_pair(FastqReadPair* read_pair)
  * Parameters: 
  * Returns:    
  *----------------------------------------------------------------------*/
-int compare_sequence(char* a, char* b, int l)
+CPU_DISPATCH int compare_sequence(char* a, char* b, int l)
 {
     int i=0;
     int differences=0;
     
     for (i=0; i<l; i++) {
+        if (a[i] == 0) {
+            differences += l - i;
+            break;
+        }
         if (tolower(a[i]) != tolower(b[i])) {
             differences++;
         }
@@ -434,195 +765,2240 @@ int match_adaptor(char*seq, int n)
 }
 
 /*----------------------------------------------------------------------*
- * Function:   
- * Purpose:    
- * Parameters: 
- * Returns:    
+ * Function:   uring_setup
+ * Purpose:    Create io_uring instance and map its rings
+ * Parameters: None
+ * Returns:    1 if successful, 0 if io_uring unavailable
  *----------------------------------------------------------------------*/
-void write_read(FastqRead* read, int trim_start, FILE* fp)
+int uring_setup(void)
 {
-    fprintf(fp, "%s\n", read->sequence_header);
-    fprintf(fp, "%s\n", (read->sequence) + trim_start);
-    fprintf(fp, "%s\n", read->qualities_header);
-    fprintf(fp, "%s\n", (read->qualities) + trim_start);
+#ifdef HAVE_IO_URING
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char* sq_ptr;
+    char* cq_ptr;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    uring.ring_fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &p);
+    if (uring.ring_fd < 0) {
+        return 0;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && (cq_size > sq_size)) {
+        sq_size = cq_size;
+    }
+
+    sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        close(uring.ring_fd);
+        return 0;
+    }
+    
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            close(uring.ring_fd);
+            return 0;
+        }
+    }
+
+    uring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        close(uring.ring_fd);
+        return 0;
+    }
+
+    uring.sq_tail = (unsigned*)(sq_ptr + p.sq_off.tail);
+    uring.sq_mask = (unsigned*)(sq_ptr + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned*)(sq_ptr + p.sq_off.array);
+    uring.cq_head = (unsigned*)(cq_ptr + p.cq_off.head);
+    uring.cq_tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+    uring.cq_mask = (unsigned*)(cq_ptr + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+    uring.in_flight = 0;
+
+    for (i=0; i<URING_QUEUE_DEPTH; i++) {
+        uring.slots[i].file = 0;
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
 }
 
 /*----------------------------------------------------------------------*
- * Function:   
- * Purpose:    
- * Parameters: 
- * Returns:    
+ * Function:   get_output_buffer
+ * Purpose:    Take a buffer from the pool, allocating if pool is empty
+ * Parameters: None
+ * Returns:    Pointer to buffer
  *----------------------------------------------------------------------*/
-void check_current_read_for_adaptors(FastqReadPair* read_pair)
+char* get_output_buffer(void)
 {
-    int i;
-    char p1[16];
-    char p2[16];
-    char temp[128];
-    int m;
-    int o;
-    int matched = 0;
-    int p1_index = -1;
-    int p2_index = -1;
-    int clip_size = 0;
-    FILE* out_r1 = undetermined_fp[0];
-    FILE* out_r2 = undetermined_fp[1];
-    
-    total_read_count++;
+    char* buffer;
     
-    // Get p2 from index read
-    strncpy(p2, read_pair->read[2].sequence, p2_size);
-    p2[p2_size] = 0;
+    if (n_free_buffers > 0) {
+        return free_buffers[--n_free_buffers];
+    }
     
-    p2_index = match_p2_adaptor(p2);
+    buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (!buffer) {
+        printf("Error: can't allocate output buffer.\n");
+        exit(12);
+    }
     
-    // Deprecated XmaI detection
-    //m = compare_sequence(read_pair->read[0].sequence + 6, "CCGGG", 5);
-    //if (m <= allowed_mismatches) {
-    //    strncpy(p1, read_pair->read[0].sequence, 6);
-    //    p1[6]=0;
-    //    printf("    Detected XmaI from base 7 with %d mismatches: %s-CCGGG p2 is %s\n", m, p1, p2);
-    //    write_read(&read_pair->read[0], 0, xmai_r1_fp);
-    //    write_read(&read_pair->read[1], 0, xmai_r2_fp);
-    //    matched = 1;
-    //} else {
+    return buffer;
+}
 
-    for (i=0; i<n_adaptors[0]; i++) {
-        if (compare_sequence(read_pair->read[0].sequence, adaptors[0][i], strlen(adaptors[0][i])) <= allowed_mismatches) {
-            p1_index = i;
-            strncpy(p1, read_pair->read[0].sequence, strlen(adaptors[0][i]));
-            p1[strlen(adaptors[0][i]) - 5] = 0;
-            matched = 1;
-            break;
-        }
+/*----------------------------------------------------------------------*
+ * Function:   release_output_buffer
+ * Purpose:    Return a buffer to the pool
+ * Parameters: buffer -> buffer to return
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void release_output_buffer(char* buffer)
+{
+    if (n_free_buffers < MAX_FREE_BUFFERS) {
+        free_buffers[n_free_buffers++] = buffer;
+    } else {
+        free(buffer);
     }
-        
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   write_blocking
+ * Purpose:    Write a buffer to a file descriptor at a given offset
+ * Parameters: fd = file descriptor
+ *             buffer -> data to write
+ *             length = number of bytes
+ *             offset = file offset to write at
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void write_blocking(int fd, char* buffer, size_t length, off_t offset)
+{
+    ssize_t written;
     
-    if (p1_index < 0) {
-        p1[0] = 0;
-        for (o=4; o<=7; o++) {
-            m = compare_sequence(read_pair->read[0].sequence + o, "TGCAG", 5);
-            if (m <= allowed_mismatches) {
-               strncpy(p1, read_pair->read[0].sequence, o);
-               p1[o] = 0;
-            }
+    while (length > 0) {
+        written = pwrite(fd, buffer, length, offset);
+        if (written < 0) {
+            printf("Error: write failed: %s\n", strerror(errno));
+            exit(8);
         }
+        buffer += written;
+        length -= written;
+        offset += written;
     }
-    
-    /*
-    for (o=4; o<=7; o++) {
-        m = compare_sequence(read_pair->read[0].sequence + o, "TGCAG", 5);
-        if (m <= allowed_mismatches) {
-            strncpy(p1, read_pair->read[0].sequence, o);
-            p1[o] = 0;
-            p1_index = match_adaptor(p1, 0);
-            //printf("    Detected PstI from base %d with %d mismatches: %s-TGCAG p2 is %s\n", o+1, m, p1, p2);
-            matched = 1;
-        }
-    }*/
-    
-    if ((matched) && (p1_index >=0) && (p2_index >=0)) {
-        //printf("p1=%s (%d)\tp2=%s (%d)\n", p1, p1_index, p2, p2_index);
-        if (out_fp[p1_index][p2_index][0] == 0) {
-            int i;
-            for (i=0; i<2; i++) {
-                char filename[MAX_PATH_LENGTH];
-                sprintf(filename, "%s_%c%d_R%d.fastq", output_prefix, p2_index+'A', p1_index+1, i+1);
-                out_fp[p1_index][p2_index][i] = fopen(filename, "w");
-                if (!out_fp[p1_index][p2_index][i]) {
-                    printf("Can't open %s\n", filename);
-                    exit(6);
-                } else {
-                    printf("Created %s\n", filename);
-                }
-            }
-        }
-        out_r1 = out_fp[p1_index][p2_index][0];
-        out_r2 = out_fp[p1_index][p2_index][1];
-        clip_size = strlen(adaptors[0][p1_index]);
-        if (clip_psti == 0) {
-            clip_size -= 5;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   uring_reap
+ * Purpose:    Wait for one io_uring completion and recycle its buffer
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void uring_reap(void)
+{
+#ifdef HAVE_IO_URING
+    unsigned head = *uring.cq_head;
+    struct io_uring_cqe* cqe;
+    URingSlot* slot;
+
+    while (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        if ((syscall(__NR_io_uring_enter, uring.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR)) {
+            printf("Error: io_uring wait failed: %s\n", strerror(errno));
+            exit(8);
         }
-        adaptor_counts[p1_index][p2_index]++;
-    } else {
-        //printf("No match\n");
-        
-        store_undetermined(0, p1);
-        store_undetermined(1, p2);
-        
-        out_r1 = undetermined_fp[0];
-        out_r2 = undetermined_fp[1];
-        clip_size = 0;
-        undetermined_read_count++;
     }
 
-    strcat(read_pair->read[0].sequence_header, " ");
-    strcat(read_pair->read[0].sequence_header, p1);
-    strcat(read_pair->read[0].sequence_header, "-");
-    strcat(read_pair->read[0].sequence_header, p2);
-    
-    write_read(&read_pair->read[0], clip_size, out_r1);
-    write_read(&read_pair->read[1], 0, out_r2);
+    cqe = &uring.cqes[head & *uring.cq_mask];
+    slot = &uring.slots[cqe->user_data];
+
+    // Errors and short writes are completed synchronously
+    if (cqe->res < 0) {
+        write_blocking(slot->file->fd, slot->buffer, slot->length, slot->offset);
+    } else if (cqe->res < slot->length) {
+        write_blocking(slot->file->fd, slot->buffer + cqe->res, slot->length - cqe->res, slot->offset + cqe->res);
+    }
+
+    __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+    slot->file->in_flight--;
+    slot->file = 0;
+    release_output_buffer(slot->buffer);
+    uring.in_flight--;
+#endif
 }
 
 /*----------------------------------------------------------------------*
- * Function:   
- * Purpose:    
- * Parameters: 
- * Returns:    
+ * Function:   uring_submit_write
+ * Purpose:    Queue an asynchronous write of an output buffer
+ * Parameters: of -> output file
+ *             buffer -> data to write, owned by io_uring until reaped
+ *             length = number of bytes
+ *             offset = file offset to write at
+ * Returns:    None
  *----------------------------------------------------------------------*/
-void read_files(FastqReadPair* read_pair)
+void uring_submit_write(OutputFile* of, char* buffer, size_t length, off_t offset)
 {
-    int i, j, k;
-    int rc = 0;
-    char filename[MAX_PATH_LENGTH];
+#ifdef HAVE_IO_URING
+    unsigned tail;
+    unsigned index;
+    struct io_uring_sqe* sqe;
+    int s;
 
-    // Clear output file handles
-    for (i=0; i<MAX_ADAPTORS; i++) {
-        for (j=0; j<MAX_ADAPTORS; j++) {
-            for (k=0; k<2; k++) {
-                out_fp[i][j][k] = 0;
-            }
-        }
+    while (uring.in_flight >= URING_QUEUE_DEPTH) {
+        uring_reap();
     }
-    
-    for (i=0; i<2; i++) {
-        sprintf(filename, "%s_undetermined_R%d.fastq", output_prefix, i+1);
-        undetermined_fp[i] = fopen(filename, "w");
-        if (!undetermined_fp[i]) {
-            printf("Error: Can't open %s\n", filename);
-            exit(5);
-        }
+
+    for (s=0; uring.slots[s].file != 0; s++);
+    uring.slots[s].file = of;
+    uring.slots[s].buffer = buffer;
+    uring.slots[s].length = length;
+    uring.slots[s].offset = offset;
+
+    tail = *uring.sq_tail;
+    index = tail & *uring.sq_mask;
+    sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = of->fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = s;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, uring.ring_fd, 1, 0, 0, NULL, 0) < 0) {
+        printf("Error: io_uring submit failed: %s\n", strerror(errno));
+        exit(8);
     }
-    
-    for (i=0; i<3; i++) {
-        read_pair->input_fp[i] = fopen(read_pair->input_filename[i], "r");
-        if (!read_pair->input_fp[i]) {
-            printf("Error: can't open %s\n", read_pair->input_filename[i]);
-            exit(2);
+
+    of->in_flight++;
+    uring.in_flight++;
+#else
+    write_blocking(of->fd, buffer, length, offset);
+    release_output_buffer(buffer);
+#endif
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   start_output_backend
+ * Purpose:    Set up io_uring if asked for, falling back to blocking
+ *             writes. Must be called before any output is opened.
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void start_output_backend(void)
+{
+    if (use_io_uring) {
+        if (uring_setup()) {
+            printf("Using io_uring for output.\n");
+        } else {
+            printf("Warning: io_uring unavailable, using blocking writes.\n");
+            use_io_uring = 0;
         }
     }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_open
+ * Purpose:    Open an output file
+ * Parameters: filename -> name of file
+ * Returns:    Pointer to OutputFile, or 0 if file can't be opened
+ *----------------------------------------------------------------------*/
+OutputFile* output_open(char* filename)
+{
+    OutputFile* of;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     
-    while ((!feof(read_pair->input_fp[0])) && (rc==0)) {
-        rc = get_next_pair(read_pair);
-        if (verbose) {
-            printf("\nPair %d: %s\n", read_pair->pairs_of_reads, read_pair->read[0].sequence_header);
-            printf("    Read 1: %s\n", read_pair->read[0].sequence);
-            printf("    Read 2: %s\n", read_pair->read[1].sequence);
-        }
-        check_current_read_for_adaptors(read_pair);
+    if (fd < 0) {
+        return 0;
     }
     
-    for (i=0; i<3; i++) {
-        fclose(read_pair->input_fp[i]);
+    of = malloc(sizeof(OutputFile));
+    if (!of) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
     }
+    
+    of->fd = fd;
+    of->buffer = get_output_buffer();
+    of->buffer_used = 0;
+    of->offset = 0;
+    of->in_flight = 0;
+    of->binary = 0;
+    
+    return of;
 }
 
 /*----------------------------------------------------------------------*
- * Function:
- * Purpose:
- * Parameters:
- * Returns:
+ * Function:   output_flush
+ * Purpose:    Send buffered data to disk, asynchronously if io_uring on
+ * Parameters: of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_flush(OutputFile* of)
+{
+    if (of->buffer_used == 0) {
+        return;
+    }
+    
+    if (use_io_uring) {
+        uring_submit_write(of, of->buffer, of->buffer_used, of->offset);
+        of->buffer = get_output_buffer();
+    } else {
+        write_blocking(of->fd, of->buffer, of->buffer_used, of->offset);
+    }
+    
+    of->offset += of->buffer_used;
+    of->buffer_used = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_write
+ * Purpose:    Append data to an output file's buffer
+ * Parameters: of -> output file
+ *             data -> data to write
+ *             length = number of bytes
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_write(OutputFile* of, char* data, size_t length)
+{
+    size_t n;
+    
+    while (length > 0) {
+        n = OUTPUT_BUFFER_SIZE - of->buffer_used;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(of->buffer + of->buffer_used, data, n);
+        of->buffer_used += n;
+        data += n;
+        length -= n;
+        if (of->buffer_used == OUTPUT_BUFFER_SIZE) {
+            output_flush(of);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_size
+ * Purpose:    Get number of bytes written to an output file so far
+ * Parameters: of -> output file
+ * Returns:    Size including data still buffered
+ *----------------------------------------------------------------------*/
+off_t output_size(OutputFile* of)
+{
+    off_t size = of->offset + of->buffer_used;
+    
+    if (of->binary) {
+        size += of->binary->block_used;
+    }
+    
+    return size;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   put_uint
+ * Purpose:    Store an unsigned value little-endian
+ * Parameters: p -> where to store value
+ *             value = value to store
+ *             bytes = number of bytes to store
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void put_uint(unsigned char* p, unsigned long long value, int bytes)
+{
+    int i;
+    
+    for (i=0; i<bytes; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_uint
+ * Purpose:    Read a little-endian unsigned value
+ * Parameters: p -> stored value
+ *             bytes = number of bytes to read
+ * Returns:    Value
+ *----------------------------------------------------------------------*/
+unsigned long long get_uint(unsigned char* p, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+    
+    for (i=bytes-1; i>=0; i--) {
+        value = (value << 8) | p[i];
+    }
+    
+    return value;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   quality_to_bin
+ * Purpose:    Map a Phred quality to one of eight Illumina-style bins
+ * Parameters: q = Phred quality
+ * Returns:    Bin number
+ *----------------------------------------------------------------------*/
+int quality_to_bin(int q)
+{
+    if (q < 2) return 0;
+    if (q < 10) return 1;
+    if (q < 20) return 2;
+    if (q < 25) return 3;
+    if (q < 30) return 4;
+    if (q < 35) return 5;
+    if (q < 40) return 6;
+    return 7;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   add_binary_index_entry
+ * Purpose:    Record the position of a block in a binary file's index
+ * Parameters: binary -> binary output state
+ *             offset = file offset of block
+ *             n_records = number of records in block
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void add_binary_index_entry(BinaryOutput* binary, off_t offset, int n_records)
+{
+    if (binary->n_blocks == binary->index_size) {
+        binary->index_size = binary->index_size ? binary->index_size * 2 : 64;
+        binary->index = realloc(binary->index, binary->index_size * sizeof(BinaryIndexEntry));
+        if (!binary->index) {
+            printf("Error: can't allocate memory.\n");
+            exit(12);
+        }
+    }
+    
+    binary->index[binary->n_blocks].offset = offset;
+    binary->index[binary->n_blocks].first_record = binary->records;
+    binary->index[binary->n_blocks].n_records = n_records;
+    binary->n_blocks++;
+    binary->records += n_records;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   allocate_binary_output
+ * Purpose:    Allocate block and index state for a binary output
+ * Parameters: None
+ * Returns:    Pointer to BinaryOutput
+ *----------------------------------------------------------------------*/
+BinaryOutput* allocate_binary_output(void)
+{
+    BinaryOutput* binary = calloc(1, sizeof(BinaryOutput));
+    
+    if (binary) {
+        binary->block_size = BINARY_BLOCK_SIZE;
+        binary->block = malloc(binary->block_size);
+    }
+    
+    if ((!binary) || (!binary->block)) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
+    }
+    
+    return binary;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   finish_binary_block
+ * Purpose:    Write the current block of a binary output and index it
+ * Parameters: of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void finish_binary_block(OutputFile* of)
+{
+    BinaryOutput* binary = of->binary;
+    unsigned char header[BINARY_BLOCK_HEADER_SIZE];
+    
+    if (binary->block_records == 0) {
+        return;
+    }
+    
+    add_binary_index_entry(binary, of->offset + of->buffer_used, binary->block_records);
+    
+    put_uint(header, binary->block_used, 4);
+    put_uint(header + 4, binary->block_records, 4);
+    output_write(of, (char*)header, BINARY_BLOCK_HEADER_SIZE);
+    output_write(of, (char*)binary->block, binary->block_used);
+    
+    binary->block_used = 0;
+    binary->block_records = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   start_binary_output
+ * Purpose:    Make an output file binary and write its file header
+ * Parameters: of -> newly opened output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void start_binary_output(OutputFile* of)
+{
+    unsigned char header[BINARY_FILE_HEADER_SIZE];
+    
+    of->binary = allocate_binary_output();
+    
+    memcpy(header, BINARY_FILE_MAGIC, 4);
+    put_uint(header + 4, BINARY_VERSION, 4);
+    put_uint(header + 8, bin_qualities ? BINARY_FLAG_BINNED_QUALITIES : 0, 4);
+    put_uint(header + 12, BINARY_BLOCK_SIZE, 4);
+    output_write(of, (char*)header, BINARY_FILE_HEADER_SIZE);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   resume_binary_output
+ * Purpose:    Rebuild the block index of a binary output truncated
+ *             back to a checkpoint, so that writing can carry on
+ * Parameters: of -> reopened output file
+ *             filename -> name of file, for messages
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void resume_binary_output(OutputFile* of, char* filename)
+{
+    unsigned char header[BINARY_BLOCK_HEADER_SIZE];
+    off_t offset = BINARY_FILE_HEADER_SIZE;
+    
+    of->binary = allocate_binary_output();
+    
+    while (offset < of->offset) {
+        if (pread(of->fd, header, BINARY_BLOCK_HEADER_SIZE, offset) != BINARY_BLOCK_HEADER_SIZE) {
+            break;
+        }
+        add_binary_index_entry(of->binary, offset, get_uint(header + 4, 4));
+        offset += BINARY_BLOCK_HEADER_SIZE + get_uint(header, 4);
+    }
+    
+    if (offset != of->offset) {
+        printf("Error: Can't resume %s - blocks don't match checkpoint\n", filename);
+        exit(9);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   end_binary_output
+ * Purpose:    Write final block, block index and footer of a binary
+ *             output, and free its state
+ * Parameters: of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void end_binary_output(OutputFile* of)
+{
+    BinaryOutput* binary = of->binary;
+    unsigned char entry[BINARY_INDEX_ENTRY_SIZE];
+    unsigned char footer[BINARY_FOOTER_SIZE];
+    off_t index_offset;
+    int i;
+    
+    finish_binary_block(of);
+    index_offset = output_size(of);
+    
+    for (i=0; i<binary->n_blocks; i++) {
+        put_uint(entry, binary->index[i].offset, 8);
+        put_uint(entry + 8, binary->index[i].first_record, 8);
+        put_uint(entry + 16, binary->index[i].n_records, 4);
+        output_write(of, (char*)entry, BINARY_INDEX_ENTRY_SIZE);
+    }
+    
+    put_uint(footer, index_offset, 8);
+    put_uint(footer + 8, binary->n_blocks, 4);
+    memcpy(footer + 12, BINARY_INDEX_MAGIC, 4);
+    output_write(of, (char*)footer, BINARY_FOOTER_SIZE);
+    
+    free(binary->block);
+    free(binary->index);
+    free(binary);
+    of->binary = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   write_read_binary
+ * Purpose:    Add a read to the current block of a binary output
+ * Parameters: read -> read to write
+ *             trim_start = number of bases to clip from start
+ *             tag -> string to append to header, or 0
+ *             of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void write_read_binary(FastqRead* read, int trim_start, char* tag, OutputFile* of)
+{
+    BinaryOutput* binary = of->binary;
+    char* sequence;
+    char* qualities;
+    unsigned char* p;
+    unsigned char* packed;
+    unsigned char* n_mask;
+    int header_length = strlen(read->sequence_header);
+    int qualities_header_length = strlen(read->qualities_header);
+    int tag_length = tag ? strlen(tag) + 1 : 0;
+    int length;
+    int has_n = 0;
+    int code;
+    int i;
+    size_t needed;
+    
+    if (trim_start > read->sequence_length) {
+        trim_start = read->sequence_length;
+    }
+    sequence = read->sequence + trim_start;
+    qualities = read->qualities + trim_start;
+    length = read->sequence_length - trim_start;
+    
+    // Header lengths are stored in 2 bytes
+    if ((header_length + tag_length > BINARY_MAX_HEADER_LENGTH) || (qualities_header_length > BINARY_MAX_HEADER_LENGTH)) {
+        printf("Error: Header of read %lld is too long for binary output\n", read->ordinal);
+        exit(10);
+    }
+    
+    // Upper bound on record size - N mask is only stored if needed
+    needed = 2 + header_length + tag_length + 2 + qualities_header_length + 1 + 4 + ((length + 3) / 4) + ((length + 7) / 8) + length;
+    if ((binary->block_used + needed > BINARY_BLOCK_SIZE) && (binary->block_records > 0)) {
+        finish_binary_block(of);
+    }
+    if (binary->block_used + needed > binary->block_size) {
+        binary->block_size = binary->block_used + needed;
+        binary->block = realloc(binary->block, binary->block_size);
+        if (!binary->block) {
+            printf("Error: can't allocate memory.\n");
+            exit(12);
+        }
+    }
+    
+    p = binary->block + binary->block_used;
+    
+    put_uint(p, header_length + tag_length, 2);
+    memcpy(p + 2, read->sequence_header, header_length);
+    p += 2 + header_length;
+    if (tag) {
+        *(p++) = ' ';
+        memcpy(p, tag, tag_length - 1);
+        p += tag_length - 1;
+    }
+    
+    put_uint(p, qualities_header_length, 2);
+    memcpy(p + 2, read->qualities_header, qualities_header_length);
+    p += 2 + qualities_header_length;
+    
+    put_uint(p + 1, length, 4);
+    packed = p + 5;
+    n_mask = packed + ((length + 3) / 4);
+    memset(packed, 0, (length + 3) / 4);
+    memset(n_mask, 0, (length + 7) / 8);
+    for (i=0; i<length; i++) {
+        switch (sequence[i]) {
+            case 'A': case 'a': code = 0; break;
+            case 'C': case 'c': code = 1; break;
+            case 'G': case 'g': code = 2; break;
+            case 'T': case 't': code = 3; break;
+            default:
+                code = 0;
+                n_mask[i / 8] |= 1 << (i % 8);
+                has_n = 1;
+                break;
+        }
+        packed[i / 4] |= code << ((i % 4) * 2);
+    }
+    p[0] = has_n ? BINARY_RECORD_HAS_N : 0;
+    p = has_n ? n_mask + ((length + 7) / 8) : n_mask;
+    
+    if (bin_qualities) {
+        for (i=0; i<length; i++) {
+            if (i % 2) {
+                p[i / 2] |= quality_to_bin(qualities[i] - QC_QUALITY_OFFSET) << 4;
+            } else {
+                p[i / 2] = quality_to_bin(qualities[i] - QC_QUALITY_OFFSET);
+            }
+        }
+        p += (length + 1) / 2;
+    } else {
+        memcpy(p, qualities, length);
+        p += length;
+    }
+    
+    binary->block_used = p - binary->block;
+    binary->block_records++;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   check_binary_record
+ * Purpose:    Make sure the next part of a record is inside its block
+ * Parameters: p -> next part of record
+ *             end -> end of block
+ *             needed = size of next part
+ *             filename -> binary file, for error message
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void check_binary_record(unsigned char* p, unsigned char* end, unsigned long long needed, char* filename)
+{
+    if ((p > end) || ((unsigned long long)(end - p) < needed)) {
+        printf("Error: %s is corrupt - record runs past end of block\n", filename);
+        exit(10);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   decode_binary_file
+ * Purpose:    Convert a binary output file back to FASTQ
+ * Parameters: in_filename -> binary file
+ *             out_filename -> FASTQ file to write
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void decode_binary_file(char* in_filename, char* out_filename)
+{
+    unsigned char header[BINARY_FILE_HEADER_SIZE];
+    unsigned char footer[BINARY_FOOTER_SIZE];
+    unsigned char entry[BINARY_INDEX_ENTRY_SIZE];
+    unsigned char* block = 0;
+    unsigned char* p;
+    unsigned char* end;
+    unsigned char* packed;
+    unsigned char* n_mask;
+    unsigned char* qualities_header;
+    unsigned long long sequence_length;
+    int qualities_header_length;
+    size_t block_length;
+    off_t index_offset;
+    off_t block_offset;
+    int n_blocks;
+    int binned;
+    int n_records;
+    int length;
+    int has_n;
+    int b, r, i;
+    long long count = 0;
+    char* line = 0;
+    FILE* in_fp = fopen(in_filename, "rb");
+    FILE* fastq_fp;
+    
+    if (!in_fp) {
+        printf("Error: can't open %s\n", in_filename);
+        exit(2);
+    }
+    
+    if ((fread(header, BINARY_FILE_HEADER_SIZE, 1, in_fp) != 1) || (memcmp(header, BINARY_FILE_MAGIC, 4) != 0) ||
+        (get_uint(header + 4, 4) != BINARY_VERSION)) {
+        printf("Error: %s is not a radplex binary file\n", in_filename);
+        exit(10);
+    }
+    binned = get_uint(header + 8, 4) & BINARY_FLAG_BINNED_QUALITIES;
+    
+    if ((fseeko(in_fp, -BINARY_FOOTER_SIZE, SEEK_END) != 0) || (fread(footer, BINARY_FOOTER_SIZE, 1, in_fp) != 1) ||
+        (memcmp(footer + 12, BINARY_INDEX_MAGIC, 4) != 0)) {
+        printf("Error: %s has no block index - file is incomplete\n", in_filename);
+        exit(10);
+    }
+    index_offset = get_uint(footer, 8);
+    n_blocks = get_uint(footer + 8, 4);
+    
+    fastq_fp = fopen(out_filename, "w");
+    if (!fastq_fp) {
+        printf("Error: Can't open %s\n", out_filename);
+        exit(5);
+    }
+    
+    for (b=0; b<n_blocks; b++) {
+        if ((fseeko(in_fp, index_offset + (off_t)b * BINARY_INDEX_ENTRY_SIZE, SEEK_SET) != 0) ||
+            (fread(entry, BINARY_INDEX_ENTRY_SIZE, 1, in_fp) != 1)) {
+            printf("Error: Can't read index of %s\n", in_filename);
+            exit(10);
+        }
+        block_offset = get_uint(entry, 8);
+        
+        if ((fseeko(in_fp, block_offset, SEEK_SET) != 0) || (fread(header, BINARY_BLOCK_HEADER_SIZE, 1, in_fp) != 1)) {
+            printf("Error: Can't read block from %s\n", in_filename);
+            exit(10);
+        }
+        block_length = get_uint(header, 4);
+        n_records = get_uint(header + 4, 4);
+        if (block_offset + BINARY_BLOCK_HEADER_SIZE + (off_t)block_length > index_offset) {
+            printf("Error: %s is corrupt - block runs past index\n", in_filename);
+            exit(10);
+        }
+        
+        block = realloc(block, block_length + 1);
+        line = realloc(line, 2 * block_length + 1);
+        if ((!block) || (!line)) {
+            printf("Error: can't allocate memory.\n");
+            exit(12);
+        }
+        if (fread(block, 1, block_length, in_fp) != block_length) {
+            printf("Error: Can't read block from %s\n", in_filename);
+            exit(10);
+        }
+        
+        p = block;
+        end = block + block_length;
+        for (r=0; r<n_records; r++) {
+            check_binary_record(p, end, 2, in_filename);
+            length = get_uint(p, 2);
+            check_binary_record(p, end, 2 + length, in_filename);
+            fprintf(fastq_fp, "%.*s\n", length, p + 2);
+            p += 2 + length;
+            
+            check_binary_record(p, end, 2, in_filename);
+            qualities_header = p + 2;
+            qualities_header_length = get_uint(p, 2);
+            check_binary_record(p, end, 2 + qualities_header_length, in_filename);
+            p += 2 + qualities_header_length;
+            
+            check_binary_record(p, end, 5, in_filename);
+            has_n = p[0] & BINARY_RECORD_HAS_N;
+            sequence_length = get_uint(p + 1, 4);
+            check_binary_record(p, end, 5 + ((sequence_length + 3) / 4) + (has_n ? ((sequence_length + 7) / 8) : 0) +
+                                (binned ? ((sequence_length + 1) / 2) : sequence_length), in_filename);
+            length = sequence_length;
+            packed = p + 5;
+            n_mask = packed + ((length + 3) / 4);
+            for (i=0; i<length; i++) {
+                if ((has_n) && (n_mask[i / 8] & (1 << (i % 8)))) {
+                    line[i] = 'N';
+                } else {
+                    line[i] = "ACGT"[(packed[i / 4] >> ((i % 4) * 2)) & 3];
+                }
+            }
+            fprintf(fastq_fp, "%.*s\n%.*s\n", length, line, qualities_header_length, qualities_header);
+            
+            p = has_n ? n_mask + ((length + 7) / 8) : n_mask;
+            if (binned) {
+                for (i=0; i<length; i++) {
+                    line[i] = binned_quality[(p[i / 2] >> ((i % 2) * 4)) & 0xF] + QC_QUALITY_OFFSET;
+                }
+                p += (length + 1) / 2;
+            } else {
+                memcpy(line, p, length);
+                p += length;
+            }
+            fprintf(fastq_fp, "%.*s\n", length, line);
+            count++;
+        }
+    }
+    
+    fclose(fastq_fp);
+    fclose(in_fp);
+    free(block);
+    free(line);
+    
+    printf("Decoded %lld reads to %s\n", count, out_filename);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_reopen
+ * Purpose:    Open an existing output file and truncate it to a size
+ *             recorded in a checkpoint
+ * Parameters: filename -> name of file
+ *             size = size to truncate to
+ * Returns:    Pointer to OutputFile
+ *----------------------------------------------------------------------*/
+OutputFile* output_reopen(char* filename, off_t size)
+{
+    OutputFile* of;
+    struct stat st;
+    int fd = open(filename, O_RDWR);
+    
+    if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size < size) || (ftruncate(fd, size) != 0)) {
+        printf("Error: Can't resume %s\n", filename);
+        exit(9);
+    }
+    
+    of = malloc(sizeof(OutputFile));
+    if (!of) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
+    }
+    
+    of->fd = fd;
+    of->buffer = get_output_buffer();
+    of->buffer_used = 0;
+    of->offset = size;
+    of->in_flight = 0;
+    of->binary = 0;
+    
+    return of;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_sync
+ * Purpose:    Flush an output file and wait until its data is on disk
+ * Parameters: of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_sync(OutputFile* of)
+{
+    if (of->binary) {
+        finish_binary_block(of);
+    }
+    output_flush(of);
+    
+    while (of->in_flight > 0) {
+        uring_reap();
+    }
+    
+    fsync(of->fd);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_close
+ * Purpose:    Flush an output file, wait for its writes and close it
+ * Parameters: of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_close(OutputFile* of)
+{
+    if (of->binary) {
+        end_binary_output(of);
+    }
+    output_flush(of);
+    
+    while (of->in_flight > 0) {
+        uring_reap();
+    }
+    
+    release_output_buffer(of->buffer);
+    close(of->fd);
+    free(of);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   write_read_manifest
+ * Purpose:    Record where a read is in its input file, instead of
+ *             writing the read itself
+ * Parameters: read -> read to record
+ *             trim_start = number of bases to clip from start
+ *             tag -> string to append to header, or 0
+ *             of -> output file
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void write_read_manifest(FastqRead* read, int trim_start, char* tag, OutputFile* of)
+{
+    char line[MAX_MANIFEST_LINE];
+    int length;
+    
+    if (tag) {
+        length = sprintf(line, "%lld\t%lld\t%d\t%s\n", read->ordinal, (long long)read->input_offset, trim_start, tag);
+    } else {
+        length = sprintf(line, "%lld\t%lld\t%d\n", read->ordinal, (long long)read->input_offset, trim_start);
+    }
+    output_write(of, line, length);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   open_read_output
+ * Purpose:    Open a sample or undetermined output in the chosen format
+ * Parameters: filename -> name of file
+ * Returns:    Pointer to OutputFile, or 0 if file can't be opened
+ *----------------------------------------------------------------------*/
+OutputFile* open_read_output(char* filename)
+{
+    OutputFile* of = output_open(filename);
+    
+    if ((of) && (output_format == OUTPUT_BINARY)) {
+        start_binary_output(of);
+    }
+    
+    return of;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   reopen_read_output
+ * Purpose:    Reopen a sample or undetermined output when resuming
+ * Parameters: filename -> name of file
+ *             size = checkpointed size
+ * Returns:    Pointer to OutputFile
+ *----------------------------------------------------------------------*/
+OutputFile* reopen_read_output(char* filename, off_t size)
+{
+    OutputFile* of = output_reopen(filename, size);
+    
+    if (output_format == OUTPUT_BINARY) {
+        resume_binary_output(of, filename);
+    }
+    
+    return of;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   
+ * Purpose:    
+ * Parameters: 
+ * Returns:    
+ *----------------------------------------------------------------------*/
+void write_read(FastqRead* read, int trim_start, char* tag, OutputFile* fp)
+{
+    int length;
+    
+    if (fp->binary) {
+        write_read_binary(read, trim_start, tag, fp);
+        return;
+    }
+    
+    if (output_format == OUTPUT_MANIFEST) {
+        write_read_manifest(read, trim_start, tag, fp);
+        return;
+    }
+    
+    if (trim_start > read->sequence_length) {
+        trim_start = read->sequence_length;
+    }
+    length = read->sequence_length - trim_start;
+    
+    output_write(fp, read->sequence_header, strlen(read->sequence_header));
+    if (tag) {
+        output_write(fp, " ", 1);
+        output_write(fp, tag, strlen(tag));
+    }
+    output_write(fp, "\n", 1);
+    output_write(fp, (read->sequence) + trim_start, length);
+    output_write(fp, "\n", 1);
+    output_write(fp, read->qualities_header, strlen(read->qualities_header));
+    output_write(fp, "\n", 1);
+    output_write(fp, (read->qualities) + trim_start, length);
+    output_write(fp, "\n", 1);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   extract_manifest_reads
+ * Purpose:    Write the reads listed in a manifest to a FASTQ file
+ * Parameters: manifest_filename -> manifest written by radplex
+ *             input_filename -> FASTQ file the manifest refers to
+ *             out_filename -> FASTQ file to write
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void extract_manifest_reads(char* manifest_filename, char* input_filename, char* out_filename)
+{
+    FILE* manifest_fp = fopen(manifest_filename, "r");
+    FILE* input_fp = fopen(input_filename, "r");
+    OutputFile* of;
+    FastqBatch* batch;
+    FastqRecord* record;
+    FastqRead read;
+    char line[MAX_MANIFEST_LINE];
+    char tag[MAX_MANIFEST_LINE];
+    long long ordinal;
+    long long offset;
+    off_t position = 0;
+    int clip;
+    int fields;
+    int l;
+    long long count = 0;
+    
+    if (!manifest_fp) {
+        printf("Error: can't open %s\n", manifest_filename);
+        exit(2);
+    }
+    if (!input_fp) {
+        printf("Error: can't open %s\n", input_filename);
+        exit(2);
+    }
+    
+    start_output_backend();
+    of = output_open(out_filename);
+    if (!of) {
+        printf("Error: Can't open %s\n", out_filename);
+        exit(5);
+    }
+    
+    // Extracted reads are always FASTQ, whatever -o asked for
+    output_format = OUTPUT_FASTQ;
+    
+    batch = allocate_batch();
+    record = &batch->record[0][0];
+    
+    while (fgets(line, MAX_MANIFEST_LINE, manifest_fp)) {
+        tag[0] = 0;
+        fields = sscanf(line, "%lld\t%lld\t%d\t%s", &ordinal, &offset, &clip, tag);
+        if (fields < 3) {
+            printf("Error: Bad line in %s\n", manifest_filename);
+            exit(11);
+        }
+        
+        // Manifests are in input order, so only seek if reads were skipped
+        if (offset != position) {
+            if (fseeko(input_fp, offset, SEEK_SET) != 0) {
+                printf("Error: Can't seek %s\n", input_filename);
+                exit(11);
+            }
+            position = offset;
+        }
+        
+        batch->arena_used = 0;
+        for (l=0; l<4; l++) {
+            if (!read_line(batch, input_fp, &record->offset[l], &record->length[l], &position)) {
+                printf("Error: Can't read record %lld from %s\n", ordinal, input_filename);
+                exit(11);
+            }
+        }
+        check_record(record, input_filename, ordinal);
+        
+        get_batch_read(batch, 0, 0, &read);
+        write_read(&read, clip, tag[0] ? tag : 0, of);
+        count++;
+    }
+    
+    output_close(of);
+    free_batch(batch);
+    fclose(input_fp);
+    fclose(manifest_fp);
+    
+    printf("Extracted %lld reads to %s\n", count, out_filename);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   allocate_qc_stats
+ * Purpose:    Allocate an empty set of QC accumulators
+ * Parameters: None
+ * Returns:    Pointer to QCStats
+ *----------------------------------------------------------------------*/
+QCStats* allocate_qc_stats(void)
+{
+    QCStats* stats = calloc(1, sizeof(QCStats));
+    
+    if (!stats) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
+    }
+    
+    return stats;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   free_qc_stats
+ * Purpose:    Free QC accumulators
+ * Parameters: stats -> accumulators to free
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void free_qc_stats(QCStats* stats)
+{
+    free(stats->position);
+    free(stats->length_histogram);
+    free(stats);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   grow_qc_stats
+ * Purpose:    Make sure per-position accumulators cover a read length
+ * Parameters: stats -> accumulators
+ *             length = read length to cover
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void grow_qc_stats(QCStats* stats, int length)
+{
+    int n = stats->positions;
+    int old_histogram_size = stats->positions > 0 ? stats->positions + 1 : 0;
+    
+    // Histogram is allocated on first use, even for an empty read
+    if ((length <= n) && (stats->length_histogram)) {
+        return;
+    }
+    
+    n = (n * 2 > length) ? n * 2 : length;
+    if (n < QC_INITIAL_POSITIONS) {
+        n = QC_INITIAL_POSITIONS;
+    }
+    
+    stats->position = realloc(stats->position, n * sizeof(QCPosition));
+    stats->length_histogram = realloc(stats->length_histogram, (n + 1) * sizeof(long));
+    if ((!stats->position) || (!stats->length_histogram)) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
+    }
+    
+    memset(stats->position + stats->positions, 0, (n - stats->positions) * sizeof(QCPosition));
+    memset(stats->length_histogram + old_histogram_size, 0, (n + 1 - old_histogram_size) * sizeof(long));
+    stats->positions = n;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   qc_add_read
+ * Purpose:    Add a read, as written out, to QC accumulators
+ * Parameters: stats -> accumulators
+ *             read -> read to add
+ *             trim_start = number of bases clipped from start of read
+ *             remnant = 1 if enzyme remnant found, 0 otherwise
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void qc_add_read(QCStats* stats, FastqRead* read, int trim_start, int remnant)
+{
+    char* sequence;
+    char* qualities;
+    int length;
+    int n_count = 0;
+    int b;
+    int i;
+    
+    if (trim_start > read->sequence_length) {
+        trim_start = read->sequence_length;
+    }
+    sequence = read->sequence + trim_start;
+    qualities = read->qualities + trim_start;
+    length = read->sequence_length - trim_start;
+    
+    grow_qc_stats(stats, length);
+    
+    for (i=0; i<length; i++) {
+        switch (sequence[i]) {
+            case 'A': case 'a': b = 0; break;
+            case 'C': case 'c': b = 1; break;
+            case 'G': case 'g': b = 2; break;
+            case 'T': case 't': b = 3; break;
+            default: b = 4; n_count++; break;
+        }
+        stats->position[i].bases[b]++;
+        stats->position[i].quality_sum += qualities[i] - QC_QUALITY_OFFSET;
+    }
+    
+    stats->reads++;
+    stats->bases += length;
+    stats->n_bases += n_count;
+    stats->length_histogram[length]++;
+    if (n_count > 0) {
+        stats->reads_with_n++;
+    }
+    if (remnant) {
+        stats->remnant_reads++;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   qc_merge_stats
+ * Purpose:    Add one set of QC accumulators into another
+ * Parameters: into -> accumulators to add to
+ *             from -> accumulators to add
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void qc_merge_stats(QCStats* into, QCStats* from)
+{
+    int i, b;
+    
+    grow_qc_stats(into, from->positions);
+    
+    for (i=0; i<from->positions; i++) {
+        into->position[i].quality_sum += from->position[i].quality_sum;
+        for (b=0; b<5; b++) {
+            into->position[i].bases[b] += from->position[i].bases[b];
+        }
+    }
+    
+    if (from->positions > 0) {
+        for (i=0; i<=from->positions; i++) {
+            into->length_histogram[i] += from->length_histogram[i];
+        }
+    }
+    
+    into->reads += from->reads;
+    into->bases += from->bases;
+    into->n_bases += from->n_bases;
+    into->reads_with_n += from->reads_with_n;
+    into->remnant_reads += from->remnant_reads;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   write_qc_report
+ * Purpose:    Write QC report for R1 and R2 of one sample
+ * Parameters: filename -> report filename
+ *             stats -> R1 and R2 accumulators
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void write_qc_report(char* filename, QCStats* stats[2])
+{
+    FILE* fp = fopen(filename, "w");
+    long count;
+    int r, i, b;
+    
+    if (!fp) {
+        printf("ERROR: Can't open %s\n", filename);
+        return;
+    }
+    
+    fprintf(fp, "#Summary\nRead\tReads\tBases\tMeanLength\tNBases\tReadsWithN\tRemnantReads\n");
+    for (r=0; r<2; r++) {
+        fprintf(fp, "R%d\t%ld\t%ld\t%.2f\t%ld\t%ld\t", r+1, stats[r]->reads, stats[r]->bases,
+                stats[r]->reads > 0 ? (double)stats[r]->bases / stats[r]->reads : 0.0,
+                stats[r]->n_bases, stats[r]->reads_with_n);
+        // Remnant only follows P1, so only applies to R1
+        if (r == 0) {
+            fprintf(fp, "%ld\n", stats[r]->remnant_reads);
+        } else {
+            fprintf(fp, "NA\n");
+        }
+    }
+    
+    fprintf(fp, "#Position\nRead\tPosition\tMeanQuality\tA\tC\tG\tT\tN\n");
+    for (r=0; r<2; r++) {
+        for (i=0; i<stats[r]->positions; i++) {
+            count = 0;
+            for (b=0; b<5; b++) {
+                count += stats[r]->position[i].bases[b];
+            }
+            if (count == 0) {
+                break;
+            }
+            fprintf(fp, "R%d\t%d\t%.2f", r+1, i+1, (double)stats[r]->position[i].quality_sum / count);
+            for (b=0; b<5; b++) {
+                fprintf(fp, "\t%ld", stats[r]->position[i].bases[b]);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+    
+    fprintf(fp, "#Length\nRead\tLength\tCount\n");
+    for (r=0; r<2; r++) {
+        for (i=0; (stats[r]->positions > 0) && (i<=stats[r]->positions); i++) {
+            if (stats[r]->length_histogram[i] > 0) {
+                fprintf(fp, "R%d\t%d\t%ld\n", r+1, i, stats[r]->length_histogram[i]);
+            }
+        }
+    }
+    
+    fclose(fp);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_qc_reports
+ * Purpose:    Write per-sample QC reports and a merged report
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_qc_reports(void)
+{
+    char filename[MAX_PATH_LENGTH];
+    QCStats* all[2];
+    int i, j, r;
+    
+    all[0] = allocate_qc_stats();
+    all[1] = allocate_qc_stats();
+    
+    for (i=0; i<MAX_ADAPTORS; i++) {
+        for (j=0; j<MAX_ADAPTORS; j++) {
+            if (qc_stats[i][j][0]) {
+                sprintf(filename, "%s_%c%d_qc.txt", output_prefix, j+'A', i+1);
+                write_qc_report(filename, qc_stats[i][j]);
+                for (r=0; r<2; r++) {
+                    qc_merge_stats(all[r], qc_stats[i][j][r]);
+                    free_qc_stats(qc_stats[i][j][r]);
+                    qc_stats[i][j][r] = 0;
+                }
+            }
+        }
+    }
+    
+    sprintf(filename, "%s_all_qc.txt", output_prefix);
+    write_qc_report(filename, all);
+    
+    free_qc_stats(all[0]);
+    free_qc_stats(all[1]);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_sample_filename
+ * Purpose:    Build output filename for a sample, including chunk number
+ * Parameters: filename -> string to store filename in
+ *             p1_index = P1 adaptor index
+ *             p2_index = P2 adaptor index
+ *             r = read number (0 or 1)
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void get_sample_filename(char* filename, int p1_index, int p2_index, int r)
+{
+    if ((chunk_reads > 0) || (chunk_bytes > 0)) {
+        sprintf(filename, "%s_%c%d_R%d_%03d.%s", output_prefix, p2_index+'A', p1_index+1, r+1, chunk_number[p1_index][p2_index], output_extension);
+    } else {
+        sprintf(filename, "%s_%c%d_R%d.%s", output_prefix, p2_index+'A', p1_index+1, r+1, output_extension);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   open_sample_files
+ * Purpose:    Open R1 and R2 output files for a sample
+ * Parameters: p1_index = P1 adaptor index
+ *             p2_index = P2 adaptor index
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void open_sample_files(int p1_index, int p2_index)
+{
+    char filename[MAX_PATH_LENGTH];
+    int i;
+    
+    chunk_number[p1_index][p2_index]++;
+    chunk_read_count[p1_index][p2_index] = 0;
+
+    for (i=0; i<2; i++) {
+        get_sample_filename(filename, p1_index, p2_index, i);
+        out_fp[p1_index][p2_index][i] = open_read_output(filename);
+        if (!out_fp[p1_index][p2_index][i]) {
+            printf("Can't open %s\n", filename);
+            exit(6);
+        } else {
+            printf("Created %s\n", filename);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   close_sample_files
+ * Purpose:    Close R1 and R2 output files for a sample and, if
+ *             chunking, record the finished chunk in the manifest
+ * Parameters: p1_index = P1 adaptor index
+ *             p2_index = P2 adaptor index
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void close_sample_files(int p1_index, int p2_index)
+{
+    char filename[2][MAX_PATH_LENGTH];
+    int i;
+    
+    for (i=0; i<2; i++) {
+        output_close(out_fp[p1_index][p2_index][i]);
+        out_fp[p1_index][p2_index][i] = 0;
+        get_sample_filename(filename[i], p1_index, p2_index, i);
+    }
+    
+    // Only written once chunk data is on disk, so downstream jobs can start on it
+    if (chunk_manifest_fp) {
+        fprintf(chunk_manifest_fp, "%c%d\t%d\t%s\t%s\t%ld\n", p2_index+'A', p1_index+1, chunk_number[p1_index][p2_index], filename[0], filename[1], chunk_read_count[p1_index][p2_index]);
+        fflush(chunk_manifest_fp);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_sample_files
+ * Purpose:    Make sure a sample's output files are open, rolling over
+ *             to a new chunk if the current one is full
+ * Parameters: p1_index = P1 adaptor index
+ *             p2_index = P2 adaptor index
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void get_sample_files(int p1_index, int p2_index)
+{
+    OutputFile** of = out_fp[p1_index][p2_index];
+    
+    if (of[0] != 0) {
+        if (((chunk_reads > 0) && (chunk_read_count[p1_index][p2_index] >= chunk_reads)) ||
+            ((chunk_bytes > 0) && ((output_size(of[0]) >= chunk_bytes) || (output_size(of[1]) >= chunk_bytes)))) {
+            close_sample_files(p1_index, p2_index);
+        }
+    }
+    
+    if (of[0] == 0) {
+        open_sample_files(p1_index, p2_index);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_p2_sequence
+ * Purpose:    Extract P2 index bases from index read, R1 header or R2
+ * Parameters: read -> R1, R2 and (optional) index reads
+ *             p2 -> string to store P2 bases in
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void get_p2_sequence(FastqRead* read, char* p2)
+{
+    char* index;
+    int i;
+    
+    if (index_source == INDEX_FROM_HEADER) {
+        // Illumina style header - index follows last colon of comment
+        index = strchr(read[0].sequence_header, ' ');
+        if (index) {
+            index = strrchr(index, ':');
+        }
+        if (!index) {
+            printf("Error: Can't find index in header %s\n", read[0].sequence_header);
+            exit(7);
+        }
+        index++;
+    } else if (index_source == INDEX_FROM_READ2) {
+        index = read[1].sequence;
+    } else {
+        index = read[2].sequence;
+    }
+
+    // Stop at end of index or start of second index in dual-index headers
+    for (i=0; (i<p2_size) && (index[i] > ' ') && (index[i] != '+'); i++) {
+        // Some headers carry a sample number rather than the index
+        if ((index_source == INDEX_FROM_HEADER) && (!strchr("ACGTNacgtn", index[i]))) {
+            printf("Error: Header %s has no index sequence - use -c to give an index read\n", read[0].sequence_header);
+            exit(7);
+        }
+        p2[i] = index[i];
+    }
+    p2[i] = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_p1_adaptor
+ * Purpose:    Find first P1 adaptor matching start of R1
+ * Parameters: read -> R1
+ * Returns:    Adaptor index, or -1 if none match
+ *----------------------------------------------------------------------*/
+int find_p1_adaptor(FastqRead* read)
+{
+    int i;
+    
+    for (i=0; i<n_adaptors[0]; i++) {
+        if (compare_sequence(read->sequence, adaptors[0][i], strlen(adaptors[0][i])) <= allowed_mismatches) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_classified_read
+ * Purpose:    Count, QC and write a read pair once its adaptors are known
+ * Parameters: read -> R1, R2 and (optional) index reads
+ *             p1_index = matching P1 adaptor, or -1
+ *             p2_index = matching P2 adaptor, or -1
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_classified_read(FastqRead* read, int p1_index, int p2_index)
+{
+    char p1[16];
+    char p2[16];
+    char tag[40];
+    int m;
+    int o;
+    int clip_size = 0;
+    int r2_clip_size = 0;
+    int remnant_start;
+    OutputFile* out_r1 = undetermined_fp[0];
+    OutputFile* out_r2 = undetermined_fp[1];
+    
+    total_read_count++;
+    
+    // Get p2 from index read, header or R2
+    get_p2_sequence(read, p2);
+    
+    if (p1_index >= 0) {
+        strncpy(p1, read[0].sequence, strlen(adaptors[0][p1_index]));
+        p1[strlen(adaptors[0][p1_index]) - 5] = 0;
+    } else {
+        p1[0] = 0;
+        for (o=4; o<=7; o++) {
+            m = compare_sequence(read[0].sequence + o, "TGCAG", 5);
+            if (m <= allowed_mismatches) {
+               strncpy(p1, read[0].sequence, o);
+               p1[o] = 0;
+            }
+        }
+    }
+    
+    /*
+    for (o=4; o<=7; o++) {
+        m = compare_sequence(read[0].sequence + o, "TGCAG", 5);
+        if (m <= allowed_mismatches) {
+            strncpy(p1, read[0].sequence, o);
+            p1[o] = 0;
+            p1_index = match_adaptor(p1, 0);
+            //printf("    Detected PstI from base %d with %d mismatches: %s-TGCAG p2 is %s\n", o+1, m, p1, p2);
+            matched = 1;
+        }
+    }*/
+    
+    if ((p1_index >=0) && (p2_index >=0)) {
+        //printf("p1=%s (%d)\tp2=%s (%d)\n", p1, p1_index, p2, p2_index);
+        get_sample_files(p1_index, p2_index);
+        out_r1 = out_fp[p1_index][p2_index][0];
+        out_r2 = out_fp[p1_index][p2_index][1];
+        clip_size = strlen(adaptors[0][p1_index]);
+        if (clip_psti == 0) {
+            clip_size -= 5;
+        }
+        if (index_source == INDEX_FROM_READ2) {
+            r2_clip_size = p2_size;
+        }
+        adaptor_counts[p1_index][p2_index]++;
+        chunk_read_count[p1_index][p2_index]++;
+        
+        if (collect_qc) {
+            if (!qc_stats[p1_index][p2_index][0]) {
+                qc_stats[p1_index][p2_index][0] = allocate_qc_stats();
+                qc_stats[p1_index][p2_index][1] = allocate_qc_stats();
+            }
+            remnant_start = strlen(adaptors[0][p1_index]) - 5;
+            qc_add_read(qc_stats[p1_index][p2_index][0], &read[0], clip_size,
+                        compare_sequence(read[0].sequence + remnant_start, "TGCAG", 5) == 0);
+            qc_add_read(qc_stats[p1_index][p2_index][1], &read[1], r2_clip_size, 0);
+        }
+    } else {
+        //printf("No match\n");
+        
+        store_undetermined(0, p1);
+        store_undetermined(1, p2);
+        
+        out_r1 = undetermined_fp[0];
+        out_r2 = undetermined_fp[1];
+        clip_size = 0;
+        undetermined_read_count++;
+    }
+
+    sprintf(tag, "%s-%s", p1, p2);
+    
+    write_read(&read[0], clip_size, tag, out_r1);
+    write_read(&read[1], r2_clip_size, 0, out_r2);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   
+ * Purpose:    
+ * Parameters: 
+ * Returns:    
+ *----------------------------------------------------------------------*/
+void check_current_read_for_adaptors(FastqRead* read)
+{
+    char p2[16];
+    int p1_index = -1;
+    int p2_index = -1;
+    
+    // Get p2 from index read, header or R2
+    get_p2_sequence(read, p2);
+    
+    p2_index = match_p2_adaptor(p2);
+    
+    // Deprecated XmaI detection
+    //m = compare_sequence(read[0].sequence + 6, "CCGGG", 5);
+    //if (m <= allowed_mismatches) {
+    //    strncpy(p1, read[0].sequence, 6);
+    //    p1[6]=0;
+    //    printf("    Detected XmaI from base 7 with %d mismatches: %s-CCGGG p2 is %s\n", m, p1, p2);
+    //    write_read(&read[0], 0, xmai_r1_fp);
+    //    write_read(&read[1], 0, xmai_r2_fp);
+    //    matched = 1;
+    //} else {
+
+    p1_index = find_p1_adaptor(&read[0]);
+    
+    output_classified_read(read, p1_index, p2_index);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   encode_prefix
+ * Purpose:    Pack the first bases of a sequence 2 bits per base
+ * Parameters: sequence -> bases to pack
+ *             sequence_length = number of bases available
+ *             length = number of bases to pack, at most 32
+ *             bases -> to store packed bases
+ *             invalid -> to store low bit of each 2-bit lane set where
+ *                        base is not ACGT or is past end of sequence
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+CPU_DISPATCH void encode_prefix(char* sequence, int sequence_length, int length, uint64_t* bases, uint64_t* invalid)
+{
+    uint64_t b = 0;
+    uint64_t n = 0;
+    uint64_t code;
+    int i;
+    
+    if (sequence_length > length) {
+        sequence_length = length;
+    }
+    
+    for (i=0; i<sequence_length; i++) {
+        code = base_code[(unsigned char)sequence[i]];
+        b |= (code & 3) << (2 * i);
+        n |= (code >> 2) << (2 * i);
+    }
+    for (; i<length; i++) {
+        n |= (uint64_t)1 << (2 * i);
+    }
+    
+    *bases = b;
+    *invalid = n;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   lane_mask
+ * Purpose:    Get mask of low bit of first n 2-bit lanes
+ * Parameters: n = number of lanes, at most 32
+ * Returns:    Mask
+ *----------------------------------------------------------------------*/
+uint64_t lane_mask(int n)
+{
+    uint64_t mask = (n >= 32) ? ~(uint64_t)0 : (((uint64_t)1 << (2 * n)) - 1);
+    
+    return mask & 0x5555555555555555ULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   setup_batch_kernel
+ * Purpose:    Pack adaptors for batch classification, if they allow it
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void setup_batch_kernel(void)
+{
+    uint64_t invalid;
+    int i, p, l;
+    
+    for (i=0; i<256; i++) {
+        base_code[i] = 4;
+    }
+    base_code['A'] = base_code['a'] = 0;
+    base_code['C'] = base_code['c'] = 1;
+    base_code['G'] = base_code['g'] = 2;
+    base_code['T'] = base_code['t'] = 3;
+    
+    batch_kernel = (p2_size <= 32);
+    p1_prefix_length = 0;
+    
+    // Adaptors with other characters, or that don't fit in 32 bases, use scalar matching
+    for (p=0; p<2; p++) {
+        for (i=0; i<n_adaptors[p]; i++) {
+            l = (p == 0) ? strlen(adaptors[p][i]) : p2_size;
+            if ((l > 32) || (strlen(adaptors[p][i]) < l)) {
+                batch_kernel = 0;
+                continue;
+            }
+            encode_prefix(adaptors[p][i], l, l, &adaptor_code[p][i], &invalid);
+            adaptor_lanes[p][i] = lane_mask(l);
+            if (invalid) {
+                batch_kernel = 0;
+            }
+            if ((p == 0) && (l > p1_prefix_length)) {
+                p1_prefix_length = l;
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   match_batch
+ * Purpose:    Find first matching adaptor for every read in a batch
+ * Parameters: n = number of reads
+ *             bases -> packed read prefixes
+ *             invalid -> invalid lanes of read prefixes
+ *             p = 0 for P1, 1 for P2
+ *             index -> to store adaptor index for each read, or -1
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+CPU_DISPATCH void match_batch(int n, uint64_t* bases, uint64_t* invalid, int p, int* index)
+{
+    uint64_t adaptor;
+    uint64_t lanes;
+    uint64_t diff;
+    int a, r;
+    
+    for (r=0; r<n; r++) {
+        index[r] = -1;
+    }
+    
+    // Last adaptor first, so that the first match overwrites later ones
+    for (a=n_adaptors[p]-1; a>=0; a--) {
+        adaptor = adaptor_code[p][a];
+        lanes = adaptor_lanes[p][a];
+        for (r=0; r<n; r++) {
+            diff = bases[r] ^ adaptor;
+            diff = (diff | (diff >> 1) | invalid[r]) & lanes;
+            index[r] = (__builtin_popcountll(diff) <= allowed_mismatches) ? a : index[r];
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   classify_batch
+ * Purpose:    Match adaptors for a whole batch, then order the batch by
+ *             sample so that each output gets a run of reads
+ * Parameters: read_pair -> input files
+ *             batch -> batch of records
+ *             c -> to store packed prefixes, results and order
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void classify_batch(FastqReadPair* read_pair, FastqBatch* batch, BatchClassification* c)
+{
+    FastqRead read[3];
+    char p2[16];
+    int n = batch->n_records;
+    int n_samples = n_adaptors[0] * n_adaptors[1] + 1;
+    int i, r, s, total;
+    
+    for (r=0; r<n; r++) {
+        for (i=0; i<read_pair->n_input_files; i++) {
+            get_batch_read(batch, r, i, &read[i]);
+        }
+        if (verbose) {
+            printf("\nPair %lld: %s\n", read[0].ordinal, read[0].sequence_header);
+            printf("    Read 1: %s\n", read[0].sequence);
+            printf("    Read 2: %s\n", read[1].sequence);
+        }
+        get_p2_sequence(read, p2);
+        encode_prefix(read[0].sequence, read[0].sequence_length, p1_prefix_length, &c->p1_bases[r], &c->p1_invalid[r]);
+        encode_prefix(p2, strlen(p2), p2_size, &c->p2_bases[r], &c->p2_invalid[r]);
+    }
+    
+    match_batch(n, c->p1_bases, c->p1_invalid, 0, c->p1_index);
+    match_batch(n, c->p2_bases, c->p2_invalid, 1, c->p2_index);
+    
+    // Stable counting sort by sample, undetermined last
+    for (s=0; s<n_samples; s++) {
+        c->sample_start[s] = 0;
+    }
+    for (r=0; r<n; r++) {
+        if ((c->p1_index[r] >= 0) && (c->p2_index[r] >= 0)) {
+            c->sample[r] = c->p1_index[r] * n_adaptors[1] + c->p2_index[r];
+        } else {
+            c->sample[r] = n_samples - 1;
+        }
+        c->sample_start[c->sample[r]]++;
+    }
+    for (s=0, total=0; s<n_samples; s++) {
+        i = c->sample_start[s];
+        c->sample_start[s] = total;
+        total += i;
+    }
+    for (r=0; r<n; r++) {
+        c->order[c->sample_start[c->sample[r]]++] = r;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   process_batch
+ * Purpose:    Classify and write every read pair in a batch
+ * Parameters: read_pair -> input files
+ *             batch -> batch of records
+ *             c -> classification workspace
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void process_batch(FastqReadPair* read_pair, FastqBatch* batch, BatchClassification* c)
+{
+    FastqRead read[3];
+    int i, k, r;
+    
+    if (!batch_kernel) {
+        for (r=0; r<batch->n_records; r++) {
+            for (i=0; i<read_pair->n_input_files; i++) {
+                get_batch_read(batch, r, i, &read[i]);
+            }
+            if (verbose) {
+                printf("\nPair %lld: %s\n", read[0].ordinal, read[0].sequence_header);
+                printf("    Read 1: %s\n", read[0].sequence);
+                printf("    Read 2: %s\n", read[1].sequence);
+            }
+            check_current_read_for_adaptors(read);
+        }
+        return;
+    }
+    
+    classify_batch(read_pair, batch, c);
+    
+    for (k=0; k<batch->n_records; k++) {
+        r = c->order[k];
+        for (i=0; i<read_pair->n_input_files; i++) {
+            get_batch_read(batch, r, i, &read[i]);
+        }
+        output_classified_read(read, c->p1_index[r], c->p2_index[r]);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_adaptor_hash
+ * Purpose:    Hash the P1 and P2 adaptor sets, so a checkpoint can only
+ *             be resumed with the same adaptors
+ * Parameters: None
+ * Returns:    64-bit FNV-1a hash of adaptors, in order
+ *----------------------------------------------------------------------*/
+unsigned long long get_adaptor_hash(void)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    char* c;
+    int p, i;
+    
+    for (p=0; p<2; p++) {
+        hash = (hash ^ n_adaptors[p]) * 1099511628211ULL;
+        for (i=0; i<n_adaptors[p]; i++) {
+            // Include terminator, so adaptors can't run into each other
+            c = adaptors[p][i];
+            do {
+                hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+            } while (*c++);
+        }
+    }
+    
+    return hash;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   write_checkpoint
+ * Purpose:    Record input offsets, output sizes and counters so that
+ *             a run can be resumed from this point
+ * Parameters: read_pair -> input files, positioned at a batch boundary
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void write_checkpoint(FastqReadPair* read_pair)
+{
+    char filename[MAX_PATH_LENGTH];
+    char temp_filename[MAX_PATH_LENGTH+4];
+    FILE* fp;
+    off_t size[2];
+    int i, j, k, r;
+    
+    sprintf(filename, "%s_checkpoint.txt", output_prefix);
+    sprintf(temp_filename, "%s.tmp", filename);
+    fp = fopen(temp_filename, "w");
+    if (!fp) {
+        printf("Error: Can't open %s\n", temp_filename);
+        exit(9);
+    }
+    
+    fprintf(fp, "radplex_checkpoint\t%d\n", CHECKPOINT_VERSION);
+    fprintf(fp, "settings\t%d\t%d\t%ld\t%ld\t%d\t%d\t%d\t%d\t%d\t%d\n", index_source, read_pair->n_input_files, chunk_reads, chunk_bytes, collect_qc, output_format, bin_qualities, allowed_mismatches, clip_psti, p2_size);
+    fprintf(fp, "adaptors\t%llx\n", get_adaptor_hash());
+    fprintf(fp, "counts\t%d\t%d\t%d\n", read_pair->pairs_of_reads, total_read_count, undetermined_read_count);
+    
+    for (i=0; i<read_pair->n_input_files; i++) {
+        fprintf(fp, "input\t%d\t%lld\n", i, (long long)ftello(read_pair->input_fp[i]));
+    }
+    
+    // Outputs must be on disk before the checkpoint that refers to them
+    for (k=0; k<2; k++) {
+        output_sync(undetermined_fp[k]);
+    }
+    fprintf(fp, "undetermined\t%lld\t%lld\n", (long long)output_size(undetermined_fp[0]), (long long)output_size(undetermined_fp[1]));
+    
+    if (chunk_manifest_fp) {
+        fflush(chunk_manifest_fp);
+        fsync(fileno(chunk_manifest_fp));
+        fprintf(fp, "manifest\t%lld\n", (long long)ftello(chunk_manifest_fp));
+    }
+    
+    for (i=0; i<MAX_ADAPTORS; i++) {
+        for (j=0; j<MAX_ADAPTORS; j++) {
+            if ((adaptor_counts[i][j] == 0) && (chunk_number[i][j] == 0)) {
+                continue;
+            }
+            for (k=0; k<2; k++) {
+                size[k] = -1;
+                if (out_fp[i][j][k]) {
+                    output_sync(out_fp[i][j][k]);
+                    size[k] = output_size(out_fp[i][j][k]);
+                }
+            }
+            fprintf(fp, "sample\t%d\t%d\t%d\t%d\t%ld\t%lld\t%lld\n", i, j, adaptor_counts[i][j], chunk_number[i][j], chunk_read_count[i][j], (long long)size[0], (long long)size[1]);
+            
+            for (r=0; (r<2) && (qc_stats[i][j][r]); r++) {
+                QCStats* stats = qc_stats[i][j][r];
+                fprintf(fp, "qc\t%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", i, j, r, stats->reads, stats->bases, stats->n_bases, stats->reads_with_n, stats->remnant_reads);
+                for (k=0; k<stats->positions; k++) {
+                    QCPosition* p = &stats->position[k];
+                    if (p->bases[0] + p->bases[1] + p->bases[2] + p->bases[3] + p->bases[4] > 0) {
+                        fprintf(fp, "qcpos\t%d\t%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n", i, j, r, k, p->quality_sum, p->bases[0], p->bases[1], p->bases[2], p->bases[3], p->bases[4]);
+                    }
+                }
+                for (k=0; (stats->positions > 0) && (k<=stats->positions); k++) {
+                    if (stats->length_histogram[k] > 0) {
+                        fprintf(fp, "qclen\t%d\t%d\t%d\t%d\t%ld\n", i, j, r, k, stats->length_histogram[k]);
+                    }
+                }
+            }
+        }
+    }
+    
+    for (i=0; i<2; i++) {
+        for (j=0; j<UNDETERMINED_HASH_SIZE; j++) {
+            if (undetermined_indices[i][j] != 0) {
+                fprintf(fp, "index\t%d\t%d\t%d\n", i, j, undetermined_indices[i][j]);
+            }
+        }
+    }
+    
+    fprintf(fp, "end\n");
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    
+    if (rename(temp_filename, filename) != 0) {
+        printf("Error: Can't rename %s\n", temp_filename);
+        exit(9);
+    }
+    
+    if (verbose) {
+        printf("Checkpoint at %d pairs\n", read_pair->pairs_of_reads);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   get_checkpoint_qc_stats
+ * Purpose:    Get QC accumulators for a checkpoint line, checking range
+ * Parameters: i = P1 index
+ *             j = P2 index
+ *             r = read number (0 or 1)
+ * Returns:    Pointer to QCStats
+ *----------------------------------------------------------------------*/
+QCStats* get_checkpoint_qc_stats(int i, int j, int r)
+{
+    if ((i < 0) || (i >= MAX_ADAPTORS) || (j < 0) || (j >= MAX_ADAPTORS) || (r < 0) || (r > 1)) {
+        printf("Error: Bad QC entry in checkpoint\n");
+        exit(9);
+    }
+    
+    if (!qc_stats[i][j][r]) {
+        qc_stats[i][j][r] = allocate_qc_stats();
+    }
+    
+    return qc_stats[i][j][r];
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   load_checkpoint
+ * Purpose:    Restore state from the last checkpoint, seek inputs and
+ *             truncate outputs back to the checkpointed sizes
+ * Parameters: read_pair -> input files, already open
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void load_checkpoint(FastqReadPair* read_pair)
+{
+    char filename[MAX_PATH_LENGTH];
+    char line[1024];
+    FILE* fp;
+    int version = 0;
+    int complete = 0;
+    int i, j, k, r, n, s;
+    long l, a, b, c, d, e, f;
+    long long size[2];
+    int settings[8];
+    long chunk_settings[2];
+    unsigned long long adaptor_hash;
+    int matched_settings = 0;
+    QCStats* stats;
+    
+    sprintf(filename, "%s_checkpoint.txt", output_prefix);
+    fp = fopen(filename, "r");
+    if (!fp) {
+        printf("Error: Can't open %s\n", filename);
+        exit(9);
+    }
+    
+    if ((!fgets(line, 1024, fp)) || (sscanf(line, "radplex_checkpoint\t%d", &version) != 1) || (version != CHECKPOINT_VERSION)) {
+        printf("Error: %s is not a radplex checkpoint\n", filename);
+        exit(9);
+    }
+    
+    while (fgets(line, 1024, fp)) {
+        if (sscanf(line, "settings\t%d\t%d\t%ld\t%ld\t%d\t%d\t%d\t%d\t%d\t%d", &settings[0], &settings[1], &chunk_settings[0], &chunk_settings[1], &settings[2], &settings[3], &settings[4], &settings[5], &settings[6], &settings[7]) == 10) {
+            if ((settings[0] != index_source) || (settings[1] != read_pair->n_input_files) ||
+                (chunk_settings[0] != chunk_reads) || (chunk_settings[1] != chunk_bytes) || (settings[2] != collect_qc) ||
+                (settings[3] != output_format) || (settings[4] != bin_qualities) || (settings[5] != allowed_mismatches) ||
+                (settings[6] != clip_psti) || (settings[7] != p2_size)) {
+                printf("Error: Options don't match those used for checkpoint\n");
+                exit(9);
+            }
+            matched_settings |= 1;
+        } else if (sscanf(line, "adaptors\t%llx", &adaptor_hash) == 1) {
+            if (adaptor_hash != get_adaptor_hash()) {
+                printf("Error: Adaptors don't match those used for checkpoint\n");
+                exit(9);
+            }
+            matched_settings |= 2;
+        } else if (sscanf(line, "counts\t%d\t%d\t%d", &read_pair->pairs_of_reads, &total_read_count, &undetermined_read_count) == 3) {
+            continue;
+        } else if (sscanf(line, "input\t%d\t%lld", &i, &size[0]) == 2) {
+            if ((i < 0) || (i >= read_pair->n_input_files) || (fseeko(read_pair->input_fp[i], size[0], SEEK_SET) != 0)) {
+                printf("Error: Can't seek input file\n");
+                exit(9);
+            }
+            read_pair->input_offset[i] = size[0];
+        } else if (sscanf(line, "undetermined\t%lld\t%lld", &size[0], &size[1]) == 2) {
+            for (k=0; k<2; k++) {
+                sprintf(filename, "%s_undetermined_R%d.%s", output_prefix, k+1, output_extension);
+                undetermined_fp[k] = reopen_read_output(filename, size[k]);
+            }
+        } else if (sscanf(line, "manifest\t%lld", &size[0]) == 1) {
+            sprintf(filename, "%s_chunks.txt", output_prefix);
+            chunk_manifest_fp = fopen(filename, "r+");
+            if ((!chunk_manifest_fp) || (ftruncate(fileno(chunk_manifest_fp), size[0]) != 0) || (fseeko(chunk_manifest_fp, size[0], SEEK_SET) != 0)) {
+                printf("Error: Can't resume %s\n", filename);
+                exit(9);
+            }
+        } else if (sscanf(line, "sample\t%d\t%d\t%d\t%d\t%ld\t%lld\t%lld", &i, &j, &n, &s, &l, &size[0], &size[1]) == 7) {
+            if ((i < 0) || (i >= MAX_ADAPTORS) || (j < 0) || (j >= MAX_ADAPTORS)) {
+                printf("Error: Bad sample entry in checkpoint\n");
+                exit(9);
+            }
+            adaptor_counts[i][j] = n;
+            chunk_number[i][j] = s;
+            chunk_read_count[i][j] = l;
+            if (size[0] >= 0) {
+                for (k=0; k<2; k++) {
+                    get_sample_filename(filename, i, j, k);
+                    out_fp[i][j][k] = reopen_read_output(filename, size[k]);
+                    printf("Resumed %s\n", filename);
+                }
+            }
+        } else if (sscanf(line, "qc\t%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld", &i, &j, &r, &a, &b, &c, &d, &e) == 8) {
+            stats = get_checkpoint_qc_stats(i, j, r);
+            stats->reads = a;
+            stats->bases = b;
+            stats->n_bases = c;
+            stats->reads_with_n = d;
+            stats->remnant_reads = e;
+        } else if (sscanf(line, "qcpos\t%d\t%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld", &i, &j, &r, &k, &l, &a, &b, &c, &d, &e) == 10) {
+            if (k < 0) {
+                printf("Error: Bad QC entry in checkpoint\n");
+                exit(9);
+            }
+            stats = get_checkpoint_qc_stats(i, j, r);
+            grow_qc_stats(stats, k+1);
+            stats->position[k].quality_sum = l;
+            stats->position[k].bases[0] = a;
+            stats->position[k].bases[1] = b;
+            stats->position[k].bases[2] = c;
+            stats->position[k].bases[3] = d;
+            stats->position[k].bases[4] = e;
+        } else if (sscanf(line, "qclen\t%d\t%d\t%d\t%d\t%ld", &i, &j, &r, &k, &f) == 5) {
+            if (k < 0) {
+                printf("Error: Bad QC entry in checkpoint\n");
+                exit(9);
+            }
+            stats = get_checkpoint_qc_stats(i, j, r);
+            grow_qc_stats(stats, k);
+            stats->length_histogram[k] = f;
+        } else if (sscanf(line, "index\t%d\t%d\t%d", &i, &j, &n) == 3) {
+            if ((i < 0) || (i > 1) || (j < 0) || (j >= UNDETERMINED_HASH_SIZE)) {
+                printf("Error: Bad index entry in checkpoint\n");
+                exit(9);
+            }
+            undetermined_indices[i][j] = n;
+        } else if (strcmp(line, "end\n") == 0) {
+            complete = 1;
+        }
+    }
+    
+    fclose(fp);
+    
+    if ((!complete) || (!undetermined_fp[0]) || (matched_settings != 3)) {
+        printf("Error: Checkpoint is incomplete\n");
+        exit(9);
+    }
+    
+    printf("Resuming from read pair %d\n", read_pair->pairs_of_reads);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   
+ * Purpose:    
+ * Parameters: 
+ * Returns:    
+ *----------------------------------------------------------------------*/
+void read_files(FastqReadPair* read_pair)
+{
+    int i, j, k;
+    int rc = 0;
+    int last_checkpoint;
+    char filename[MAX_PATH_LENGTH];
+    FastqBatch* batch = allocate_batch();
+    BatchClassification* classification = malloc(sizeof(BatchClassification));
+    
+    if (!classification) {
+        printf("Error: can't allocate memory.\n");
+        exit(12);
+    }
+
+    start_output_backend();
+
+    // Clear output file handles
+    for (i=0; i<MAX_ADAPTORS; i++) {
+        for (j=0; j<MAX_ADAPTORS; j++) {
+            for (k=0; k<2; k++) {
+                out_fp[i][j][k] = 0;
+            }
+            chunk_number[i][j] = 0;
+            chunk_read_count[i][j] = 0;
+            qc_stats[i][j][0] = 0;
+            qc_stats[i][j][1] = 0;
+        }
+    }
+    
+    for (i=0; i<read_pair->n_input_files; i++) {
+        read_pair->input_fp[i] = fopen(read_pair->input_filename[i], "r");
+        if (!read_pair->input_fp[i]) {
+            printf("Error: can't open %s\n", read_pair->input_filename[i]);
+            exit(2);
+        }
+    }
+    
+    if (resume_run) {
+        load_checkpoint(read_pair);
+        resumed_read_count = total_read_count;
+    } else {
+        if ((chunk_reads > 0) || (chunk_bytes > 0)) {
+            sprintf(filename, "%s_chunks.txt", output_prefix);
+            chunk_manifest_fp = fopen(filename, "w");
+            if (!chunk_manifest_fp) {
+                printf("Error: Can't open %s\n", filename);
+                exit(5);
+            }
+            fprintf(chunk_manifest_fp, "Sample\tChunk\tR1\tR2\tReads\n");
+        }
+        
+        for (i=0; i<2; i++) {
+            sprintf(filename, "%s_undetermined_R%d.%s", output_prefix, i+1, output_extension);
+            undetermined_fp[i] = open_read_output(filename);
+            if (!undetermined_fp[i]) {
+                printf("Error: Can't open %s\n", filename);
+                exit(5);
+            }
+        }
+    }
+    
+    last_checkpoint = read_pair->pairs_of_reads;
+    
+    while (rc == 0) {
+        rc = get_next_batch(read_pair, batch);
+        process_batch(read_pair, batch, classification);
+        
+        if ((checkpoint_interval > 0) && (rc == 0) && (read_pair->pairs_of_reads - last_checkpoint >= checkpoint_interval)) {
+            write_checkpoint(read_pair);
+            last_checkpoint = read_pair->pairs_of_reads;
+        }
+    }
+    
+    for (i=0; i<read_pair->n_input_files; i++) {
+        fclose(read_pair->input_fp[i]);
+    }
+    
+    free_batch(batch);
+    free(classification);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   close_output_files
+ * Purpose:    Flush and close all sample and undetermined outputs
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void close_output_files(void)
+{
+    int i, j;
+    
+    for (i=0; i<MAX_ADAPTORS; i++) {
+        for (j=0; j<MAX_ADAPTORS; j++) {
+            if (out_fp[i][j][0]) {
+                close_sample_files(i, j);
+            }
+        }
+    }
+    
+    for (i=0; i<2; i++) {
+        output_close(undetermined_fp[i]);
+        undetermined_fp[i] = 0;
+    }
+    
+    if (chunk_manifest_fp) {
+        fclose(chunk_manifest_fp);
+        chunk_manifest_fp = 0;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:
+ * Purpose:
+ * Parameters:
+ * Returns:
  *----------------------------------------------------------------------*/
 void display_adaptors(void)
 {
@@ -651,7 +3027,7 @@ void display_adaptors(void)
  *----------------------------------------------------------------------*/
 void load_adaptor_files(void)
 {
-    int i,j;
+    int i;
     
     for (i=0; i<2; i++) {
         FILE* fp = fopen(adaptor_filename[i], "r");
@@ -718,6 +3094,25 @@ void display_counts(void)
     printf("Total\t\t\t%d\t100\n", total_read_count);
 }
 
+/*----------------------------------------------------------------------*
+ * Function:   display_throughput
+ * Purpose:    Report read pairs processed per second
+ * Parameters: start -> time processing started
+ *             end -> time processing ended
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void display_throughput(struct timespec* start, struct timespec* end)
+{
+    double seconds = (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+    int processed = total_read_count - resumed_read_count;
+    
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    
+    printf("\nProcessed %d read pairs in %.2f seconds (%.0f reads/s)\n", processed, seconds, processed / seconds);
+}
+
 /*----------------------------------------------------------------------*
 * Function:   
 * Purpose:    
@@ -728,9 +3123,11 @@ void initialise_read_pair_struct(FastqReadPair* r)
 {
     int i;
     r->pairs_of_reads = 0;
+    r->n_input_files = 3;
     for (i=0; i<3; i++) {
         r->input_filename[i] = 0;
         r->input_fp[i] = 0;
+        r->input_offset[i] = 0;
     }
 }
 
@@ -747,11 +3144,22 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
         {"one", required_argument, NULL, 'a'},
         {"two", required_argument, NULL, 'b'},
         {"index", required_argument, NULL, 'c'},
+        {"decode", required_argument, NULL, 'd'},
+        {"extract", required_argument, NULL, 'e'},
         {"help", no_argument, NULL, 'h'},
+        {"index_source", required_argument, NULL, 'i'},
+        {"chunk_bytes", required_argument, NULL, 'k'},
+        {"bin_qualities", no_argument, NULL, 'l'},
         {"mismatches", required_argument, NULL, 'm'},
+        {"output_format", required_argument, NULL, 'o'},
         {"output_prefix", required_argument, NULL, 'p'},
+        {"qc", no_argument, NULL, 'q'},
+        {"chunk_reads", required_argument, NULL, 'r'},
         {"p2_size", required_argument, NULL, 's'},
+        {"io_uring", no_argument, NULL, 'u'},
         {"verbose", no_argument, NULL, 'v'},
+        {"checkpoint", required_argument, NULL, 'x'},
+        {"resume", no_argument, NULL, 'y'},
         {"clip_psti", no_argument, NULL, 'z'},
         {"p1", required_argument, NULL, '1'},
         {"p2", required_argument, NULL, '2'},
@@ -760,9 +3168,23 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
     int opt;
     int longopt_index;
     
-    while ((opt = getopt_long(argc, argv, "a:b:c:hm:p:s:vz1:2:", long_options, &longopt_index)) > 0)
+    while ((opt = getopt_long(argc, argv, "a:b:c:d:e:hi:k:lm:o:p:qr:s:uvx:yz1:2:", long_options, &longopt_index)) > 0)
     {
         switch(opt) {
+            case 'd':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                decode_filename = optarg;
+                break;
+            case 'e':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                extract_filename = optarg;
+                break;
             case 'h':
                 usage();
                 exit(0);
@@ -791,6 +3213,32 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
                 read_pair->input_filename[2] = malloc(strlen(optarg)+1);
                 strcpy(read_pair->input_filename[2], optarg);
                 break;
+            case 'i':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                if (strcmp(optarg, "file") == 0) {
+                    index_source = INDEX_FROM_FILE;
+                } else if (strcmp(optarg, "header") == 0) {
+                    index_source = INDEX_FROM_HEADER;
+                } else if (strcmp(optarg, "read2") == 0) {
+                    index_source = INDEX_FROM_READ2;
+                } else {
+                    printf("Error: Unknown index source %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                chunk_bytes=atol(optarg);
+                break;
+            case 'l':
+                bin_qualities = 1;
+                break;
             case 'm':
                 if (optarg==NULL) {
                     printf("Error: Option requires an argument.\n");
@@ -798,13 +3246,47 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
                 }
                 allowed_mismatches=atoi(optarg);
                 break;
+            case 'o':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                if (strcmp(optarg, "fastq") == 0) {
+                    output_format = OUTPUT_FASTQ;
+                    output_extension = "fastq";
+                } else if (strcmp(optarg, "binary") == 0) {
+                    output_format = OUTPUT_BINARY;
+                    output_extension = "rpb";
+                } else if (strcmp(optarg, "manifest") == 0) {
+                    output_format = OUTPUT_MANIFEST;
+                    output_extension = "manifest";
+                } else {
+                    printf("Error: Unknown output format %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case 'p':
                 if (optarg==NULL) {
                     printf("Error: Option requires an argument.\n");
                     exit(1);
                 }
+                // Leave room for the longest suffix added to output filenames
+                if (strlen(optarg) >= MAX_PREFIX_LENGTH) {
+                    printf("Error: Output prefix is too long.\n");
+                    exit(1);
+                }
                 strcpy(output_prefix, optarg);
                 break;
+            case 'q':
+                collect_qc = 1;
+                break;
+            case 'r':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                chunk_reads=atol(optarg);
+                break;
             case 's':
                 if (optarg==NULL) {
                     printf("Error: Option requires an argument.\n");
@@ -812,9 +3294,22 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
                 }
                 p2_size=atoi(optarg);
                 break;
+            case 'u':
+                use_io_uring = 1;
+                break;
             case 'v':
                 verbose = 1;
                 break;
+            case 'x':
+                if (optarg==NULL) {
+                    printf("Error: Option requires an argument.\n");
+                    exit(1);
+                }
+                checkpoint_interval=atoi(optarg);
+                break;
+            case 'y':
+                resume_run = 1;
+                break;
             case 'z':
                 clip_psti = 1;
                 break;
@@ -835,11 +3330,38 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
         }
     }
     
-    if ((read_pair->input_filename[0] == 0) || (read_pair->input_filename[1] == 0) || (read_pair->input_filename[2] == 0)) {
+    if (decode_filename) {
+        char filename[MAX_PATH_LENGTH];
+        sprintf(filename, "%s.fastq", output_prefix);
+        decode_binary_file(decode_filename, filename);
+        exit(0);
+    }
+    
+    if (extract_filename) {
+        char filename[MAX_PATH_LENGTH];
+        if (read_pair->input_filename[0] == 0) {
+            printf("Error: you must specify the input FASTQ with -a.\n");
+            exit(2);
+        }
+        sprintf(filename, "%s.fastq", output_prefix);
+        extract_manifest_reads(extract_filename, read_pair->input_filename[0], filename);
+        exit(0);
+    }
+    
+    if ((read_pair->input_filename[0] == 0) || (read_pair->input_filename[1] == 0)) {
         printf("Error: you must specify both reads.\n");
         exit(2);
     }
     
+    if (index_source == INDEX_FROM_FILE) {
+        if (read_pair->input_filename[2] == 0) {
+            printf("Error: you must specify an index read, or use --index_source.\n");
+            exit(2);
+        }
+    } else {
+        read_pair->n_input_files = 2;
+    }
+    
     if ((adaptor_filename[0][0] == 0) || (adaptor_filename[1][0] == 0)) {
         printf("Using default adaptors.\n");
         setup_default_adaptors();
@@ -847,6 +3369,8 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
         load_adaptor_files();
     }
     
+    setup_batch_kernel();
+    
     printf("Allowed mismatches: %d\n\n", allowed_mismatches);
 }
 
@@ -856,6 +3380,8 @@ void parse_command_line(int argc, char* argv[], FastqReadPair* read_pair)
 int main(int argc, char* argv[])
 {
     FastqReadPair read_pair;
+    struct timespec start_time;
+    struct timespec end_time;
     
     printf("\nRADplex v0.6\n\n");
     
@@ -868,11 +3394,26 @@ int main(int argc, char* argv[])
     initialise_read_pair_struct(&read_pair);
     parse_command_line(argc, argv, &read_pair);
     display_adaptors();
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
     read_files(&read_pair);
+    close_output_files();
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
     display_counts();
+    display_throughput(&start_time, &end_time);
 
     output_undetermined_indices();
     
+    if (collect_qc) {
+        output_qc_reports();
+    }
+    
+    // Run is complete, so an old checkpoint must not be resumed from
+    if ((checkpoint_interval > 0) || (resume_run)) {
+        char filename[MAX_PATH_LENGTH];
+        sprintf(filename, "%s_checkpoint.txt", output_prefix);
+        unlink(filename);
+    }
+    
     printf("\nDone.\n");
     
     return 0;
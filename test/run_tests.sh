@@ -0,0 +1,164 @@
+#!/bin/sh
+#
+# Regression checks for radplex.
+#
+# Usage: run_tests.sh <radplex>
+#
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 <radplex>"
+    exit 1
+fi
+
+radplex=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+generate_reads=$(cd "$(dirname "$0")/../bench" && pwd)/generate_reads.sh
+work=$(mktemp -d "${TMPDIR:-/tmp}/radplex_test.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+pass() {
+    echo "PASS: $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    failed=1
+}
+
+# Write one FASTQ record, with qualities to match the sequence
+# Usage: record <header> <sequence>
+record() {
+    printf '%s\n%s\n+\n%s\n' "$1" "$2" "$(printf '%s' "$2" | tr 'ACGTNacgtn' 'IIIIIIIIII')"
+}
+
+# Compare every output file, other than logs, in two directories
+# Usage: same_outputs <directory> <directory>
+same_outputs() {
+    [ "$(ls "$1" | grep -v '\.log$')" = "$(ls "$2" | grep -v '\.log$')" ] || return 1
+    for f in $(ls "$1" | grep -v '\.log$'); do
+        cmp -s "$1/$f" "$2/$f" || return 1
+    done
+}
+
+# Stop a checkpointed run part way, then resume it, and compare with
+# an uninterrupted run. The run is stopped by a malformed record in the
+# fourth batch, after the checkpoint at 8192 pairs and after the third
+# batch has been partly written, so resume has to truncate outputs.
+# Both runs checkpoint, as checkpoints also end binary output blocks.
+# Usage: check_resume <name> <options>
+check_resume() {
+    name=$1
+    shift
+    mkdir full_$name resumed_$name
+    (cd full_$name && "$radplex" -x 8192 "$@" -a ../resume_r1.fq -b ../resume_r2.fq -c ../resume_i.fq -p o > run.log 2>&1)
+    (cd resumed_$name && "$radplex" -x 8192 "$@" -a ../broken_r1.fq -b ../resume_r2.fq -c ../resume_i.fq -p o > stopped.log 2>&1)
+    if [ $? -ne 7 ] || ! grep -q "^counts	8192	" resumed_$name/o_checkpoint.txt; then
+        fail "Resume $name - run did not stop after checkpoint"
+        return
+    fi
+    (cd resumed_$name && "$radplex" -x 8192 -y "$@" -a ../resume_r1.fq -b ../resume_r2.fq -c ../resume_i.fq -p o > resume.log 2>&1)
+    if [ $? -eq 0 ] && same_outputs full_$name resumed_$name; then
+        pass "Resume $name"
+    else
+        fail "Resume $name"
+    fi
+}
+
+cd "$work" || exit 1
+
+# QC of a sample whose first read is empty
+record "@r1 1:N:0:AATAGTT" "TGAGTGCAGACGTACGT" > empty_r1.fq
+record "@r1 2:N:0:AATAGTT" "" > empty_r2.fq
+record "@r1 3:N:0:AATAGTT" "AATAGTT" > empty_i.fq
+if "$radplex" -q -a empty_r1.fq -b empty_r2.fq -c empty_i.fq -p empty > empty.log 2>&1 && [ -f empty_A1_qc.txt ]; then
+    pass "QC with empty R2"
+else
+    fail "QC with empty R2"
+fi
+
+# QC when R2 is all barcode, so nothing is left after clipping
+record "@r1 2:N:0:AATAGTT" "AATAGTT" > barcode_r2.fq
+if "$radplex" -q -i read2 -a empty_r1.fq -b barcode_r2.fq -p barcode > barcode.log 2>&1 && [ -f barcode_A1_qc.txt ]; then
+    pass "QC with R2 clipped to nothing"
+else
+    fail "QC with R2 clipped to nothing"
+fi
+
+# Header with a sample number instead of an index fails cleanly
+record "@r1 1:N:0:2" "TGAGTGCAGACGTACGT" > number_r1.fq
+"$radplex" -i header -a number_r1.fq -b empty_r2.fq -p number > number.log 2>&1
+if [ $? -eq 7 ] && grep -q "has no index sequence" number.log; then
+    pass "Header without index sequence"
+else
+    fail "Header without index sequence"
+fi
+
+# Extracting from a manifest writes FASTQ, even with -o manifest
+"$radplex" -o manifest -a empty_r1.fq -b empty_r2.fq -c empty_i.fq -p extract > extract.log 2>&1
+if "$radplex" -o manifest -e extract_A1_R1.manifest -a empty_r1.fq -p extracted >> extract.log 2>&1 &&
+   [ "$(sed -n 1p extracted.fastq)" = "@r1 1:N:0:AATAGTT TGAG-AATAGTT" ] && [ "$(sed -n 2p extracted.fastq)" = "TGCAGACGTACGT" ]; then
+    pass "Extract with -o manifest"
+else
+    fail "Extract with -o manifest"
+fi
+
+# Extracting with io_uring output
+if "$radplex" -u -e extract_A1_R1.manifest -a empty_r1.fq -p extracted_uring >> extract.log 2>&1 &&
+   cmp -s extracted.fastq extracted_uring.fastq; then
+    pass "Extract with -u"
+else
+    fail "Extract with -u"
+fi
+
+# Synthetic reads for the remaining checks
+sh "$generate_reads" 16000 resume_data > /dev/null || exit 1
+mv resume_data/r1.fq resume_r1.fq
+mv resume_data/r2.fq resume_r2.fq
+mv resume_data/i.fq resume_i.fq
+
+# Binary output decodes to the same FASTQ, with binned qualities if -l
+mkdir fastq binary binned
+(cd fastq && "$radplex" -a ../resume_r1.fq -b ../resume_r2.fq -c ../resume_i.fq -p o > run.log 2>&1)
+(cd binary && "$radplex" -o binary -a ../resume_r1.fq -b ../resume_r2.fq -c ../resume_i.fq -p o > run.log 2>&1)
+(cd binned && "$radplex" -o binary -l -a ../resume_r1.fq -b ../resume_r2.fq -c ../resume_i.fq -p o > run.log 2>&1)
+for mode in binary binned; do
+    ok=1
+    for f in fastq/*.fastq; do
+        name=$(basename "$f" .fastq)
+        "$radplex" -d $mode/$name.rpb -p $mode/decoded > /dev/null 2>&1 || ok=0
+        if [ $mode = binary ]; then
+            cp "$f" expected.fastq
+        else
+            awk 'BEGIN {
+                     for (i = 33; i < 127; i++) {
+                         q = i - 33
+                         b = (q < 2) ? 0 : (q < 10) ? 6 : (q < 20) ? 15 : (q < 25) ? 22 : (q < 30) ? 27 : (q < 35) ? 33 : (q < 40) ? 37 : 40
+                         bin[sprintf("%c", i)] = sprintf("%c", b + 33)
+                     }
+                 }
+                 NR % 4 == 0 {
+                     s = ""
+                     for (i = 1; i <= length($0); i++) {
+                         s = s bin[substr($0, i, 1)]
+                     }
+                     $0 = s
+                 }
+                 { print }' "$f" > expected.fastq
+        fi
+        cmp -s expected.fastq $mode/decoded.fastq || ok=0
+    done
+    if [ $ok = 1 ] && [ -n "$(ls fastq/*.fastq)" ]; then
+        pass "Binary round trip ($mode)"
+    else
+        fail "Binary round trip ($mode)"
+    fi
+done
+
+# Checkpoint and resume
+awk 'NR == 13000 * 4 { $0 = substr($0, 2) } { print }' resume_r1.fq > broken_r1.fq
+check_resume fastq
+check_resume qc_chunks -q -r 300
+check_resume binary -u -o binary -k 100000
+check_resume manifest -o manifest
+
+exit $failed